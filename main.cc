@@ -4,15 +4,35 @@
  * Written by Frank Mehnert <frank.mehnert@gmail.com>
  */
 
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <cctype>
+#include <cstdarg>
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <signal.h>
 #include <term.h>
 #include <termios.h>
@@ -22,6 +42,7 @@
 namespace {
 
 #define USED    __attribute__((unused))
+#define NOINLINE __attribute__((noinline))
 #define DEVICE  "ttyUSB0"
 
 // Protocol:
@@ -50,13 +71,36 @@ namespace {
 //  [3]:    variable index
 //  [4]:    0x55
 //
+// STATUS BROADCAST (from master, 27 bytes):
+//  [0..1]:   0xff 0xff
+//  [3..8]:   day, weekday, month, year, hour, minutes
+//  [9]:      fan level
+//  [10]:     1 = fan AUTO
+//  [11..25]: unknown
+//
 // RJ12: GND = 0 (red)
 //               (braun)
 //               (grün)
 
 static unsigned _maxy;
-static bool     _terminate   = false;
+static std::atomic<bool> _terminate{false};
+static std::atomic<bool> _winch{false};
 static bool     _interactive = false;
+static int      _command_fd = -1;     // eventfd: commands queued
+
+// heap allocations of the process, see operator new at the end of the
+// namespace; all buffers and pools exist before the loop starts
+static std::atomic<uint32_t> _heap_allocs{0};
+static std::atomic<uint32_t> _heap_loop{0};  // _heap_allocs at loop start
+static std::atomic<bool> _heap_loop_started{false};
+
+static uint32_t heap_allocs_in_loop()
+{
+  if (!_heap_loop_started.load(std::memory_order_acquire))
+    return 0;
+  return   _heap_allocs.load(std::memory_order_relaxed)
+         - _heap_loop.load(std::memory_order_relaxed);
+}
 
 enum
 {
@@ -138,61 +182,176 @@ enum
   Var_67_unknown          = 0x67, // 32-bit 0x00 0x00 0x0f 0x0f
 };
 
-static char const *get_var_name(unsigned var)
+// Value layout of a variable as transferred on the bus.
+enum Var_type : uint8_t
 {
-  switch (var)
-    {
-    case Var_00_calendar_mon:     return "calendar monday";
-    case Var_01_calendar_tue:     return "calendar tuesday";
-    case Var_02_calendar_wed:     return "calendar wednesday";
-    case Var_03_calendar_thu:     return "calendar thursday";
-    case Var_04_calendar_fri:     return "calendar friday";
-    case Var_05_calendar_sat:     return "calendar saturday";
-    case Var_06_calendar_sun:     return "calendar sunday";
-    case Var_07_date_month_year:  return "date month year";
-    case Var_08_time_hour_min:    return "time hour min";
-    case Var_0d_back_up_heating:  return "back up heating";
-    case Var_0e_preheat_temp:     return "preheating temperatur";
-    case Var_0f_party_enabled:    return "party enabled";
-    case Var_10_party_curr_time:  return "party current time";
-    case Var_11_party_time:       return "party time";
-    case Var_14_ext_contact:      return "external contact";
-    case Var_15_hours_on:         return "hours on";
-    case Var_16_fan_1_voltage:    return "fan 1 voltage";
-    case Var_17_fan_2_voltage:    return "fan 2 voltage";
-    case Var_18_fan_3_voltage:    return "fan 3 voltage";
-    case Var_19_fan_4_voltage:    return "fan 4 voltage";
-    case Var_1a_vacation_start:   return "vacation start";
-    case Var_1b_vacation_end:     return "vacation end";
-    case Var_1e_bypass1_temp:     return "bypass1 temperature";
-    case Var_1f_frostschutz:      return "frostschutz";
-    case Var_21_weekoffs_co2:     return "week offset co2";
-    case Var_22_weekoffs_humdty:  return "week offset humdty";
-    case Var_23_weekoffs_temp:    return "week offset temp";
-    case Var_35_fan_level:        return "fan level";
-    case Var_37_min_fan_level:    return "minimum fan level";
-    case Var_38_change_filter:    return "change filter";
-    case Var_3a_sensors_temp:     return "sensors temperature";
-    case Var_3b_sensors_co2:      return "sensors co2";
-    case Var_3c_sensors_humidity: return "sensors humidity";
-    case Var_42_party_level:      return "party level";
-    case Var_45_zuluft_level:     return "zuluft level";
-    case Var_46_abluft_level:     return "abluft level";
-    case Var_48_software_version: return "software version";
-    case Var_49_nachlaufzeit:     return "nachlaufzeit";
-    case Var_4e_vacation_enabled: return "vacation enabled";
-    case Var_4f_preheat_enabled:  return "preheating enabled";
-    case Var_50_preheat_temp:     return "preheating temperature";
-    case Var_52_weekoffs_enabled: return "week offset enabled";
-    case Var_54_quiet_curr_time:  return "quiet current time";
-    case Var_55_quiet_enabled:    return "quiet enabled";
-    case Var_56_quiet_time:       return "quiet time";
-    case Var_57_quiet_level:      return "quiet_level";
-    case Var_60_bypass2_temp:     return "bypass2 temperature";
-    default:                      return "unknown";
-    }
+  Vt_raw,                         // uninterpreted bytes
+  Vt_u8,                          // 8-bit values
+  Vt_u16,                         // 16-bit values
+  Vt_u32,                         // 32-bit values
+  Vt_tenths,                      // 16-bit values in 10th
+  Vt_date,                        // day, month, year
+  Vt_time,                        // hour, minutes
+  Vt_calendar,                    // 3 bytes, then 24 x 2 half-hour levels
+};
+
+// How a variable may be accessed.
+enum Var_flags : uint8_t
+{
+  Vf_rw       = 0,
+  Vf_ro       = 1,                // cannot be written (sensors, counters)
+  Vf_wo       = 2,                // cannot be read
+  Vf_volatile = 4,                // changes by itself, not configuration
+};
+
+struct Var_desc
+{
+  uint8_t     idx;
+  Var_type    type;
+  uint8_t     count;              // number of values (bytes for Vt_raw)
+  uint16_t    invalid;            // value of a missing sensor (0 = none)
+  uint8_t     flags;              // Var_flags
+  char const *name;               // human readable
+  char const *key;                // machine readable
+};
+
+// Sorted by index.
+static Var_desc const var_descs[] =
+{
+  { Var_00_calendar_mon,     Vt_calendar,  1,    0, Vf_rw,       "calendar monday",        "calendar_mon" },
+  { Var_01_calendar_tue,     Vt_calendar,  1,    0, Vf_rw,       "calendar tuesday",       "calendar_tue" },
+  { Var_02_calendar_wed,     Vt_calendar,  1,    0, Vf_rw,       "calendar wednesday",     "calendar_wed" },
+  { Var_03_calendar_thu,     Vt_calendar,  1,    0, Vf_rw,       "calendar thursday",      "calendar_thu" },
+  { Var_04_calendar_fri,     Vt_calendar,  1,    0, Vf_rw,       "calendar friday",        "calendar_fri" },
+  { Var_05_calendar_sat,     Vt_calendar,  1,    0, Vf_rw,       "calendar saturday",      "calendar_sat" },
+  { Var_06_calendar_sun,     Vt_calendar,  1,    0, Vf_rw,       "calendar sunday",        "calendar_sun" },
+  { Var_07_date_month_year,  Vt_date,      1,    0, Vf_volatile, "date month year",        "date" },
+  { Var_08_time_hour_min,    Vt_time,      1,    0, Vf_volatile, "time hour min",          "time" },
+  { Var_0d_back_up_heating,  Vt_u8,        1,    0, Vf_rw,       "back up heating",        "back_up_heating" },
+  { Var_0e_preheat_temp,     Vt_tenths,    1,    0, Vf_ro,       "preheating temperatur",  "preheat_sensor_temp" },
+  { Var_0f_party_enabled,    Vt_u8,        1,    0, Vf_wo,       "party enabled",          "party_enabled" },
+  { Var_10_party_curr_time,  Vt_u16,       1,    0, Vf_volatile, "party current time",     "party_curr_time" },
+  { Var_11_party_time,       Vt_u16,       1,    0, Vf_rw,       "party time",             "party_time" },
+  { Var_14_ext_contact,      Vt_u8,        1,    0, Vf_rw,       "external contact",       "ext_contact" },
+  { Var_15_hours_on,         Vt_u32,       1,    0, Vf_ro,       "hours on",               "hours_on" },
+  { Var_16_fan_1_voltage,    Vt_tenths,    2,    0, Vf_rw,       "fan 1 voltage",          "fan_1_voltage" },
+  { Var_17_fan_2_voltage,    Vt_tenths,    2,    0, Vf_rw,       "fan 2 voltage",          "fan_2_voltage" },
+  { Var_18_fan_3_voltage,    Vt_tenths,    2,    0, Vf_rw,       "fan 3 voltage",          "fan_3_voltage" },
+  { Var_19_fan_4_voltage,    Vt_tenths,    2,    0, Vf_rw,       "fan 4 voltage",          "fan_4_voltage" },
+  { Var_1a_vacation_start,   Vt_date,      1,    0, Vf_rw,       "vacation start",         "vacation_start" },
+  { Var_1b_vacation_end,     Vt_date,      1,    0, Vf_rw,       "vacation end",           "vacation_end" },
+  { Var_1c_unknown,          Vt_u16,       1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_1d_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_1e_bypass1_temp,     Vt_tenths,    1,    0, Vf_rw,       "bypass1 temperature",    "bypass1_temp" },
+  { Var_1f_frostschutz,      Vt_tenths,    1,    0, Vf_rw,       "frostschutz",            "frostschutz" },
+  { Var_20_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_21_weekoffs_co2,     Vt_u8,        1,    0, Vf_rw,       "week offset co2",        "weekoffs_co2" },
+  { Var_22_weekoffs_humdty,  Vt_u8,        1,    0, Vf_rw,       "week offset humdty",     "weekoffs_humdty" },
+  { Var_23_weekoffs_temp,    Vt_u8,        1,    0, Vf_rw,       "week offset temp",       "weekoffs_temp" },
+  { Var_35_fan_level,        Vt_u8,        2,    0, Vf_volatile, "fan level",              "fan_level" },
+  { Var_37_min_fan_level,    Vt_u8,        1,    0, Vf_rw,       "minimum fan level",      "min_fan_level" },
+  { Var_38_change_filter,    Vt_u8,        1,    0, Vf_volatile, "change filter",          "change_filter" },
+  { Var_3a_sensors_temp,     Vt_tenths,   10, 9990, Vf_ro,       "sensors temperature",    "sensors_temp" },
+  { Var_3b_sensors_co2,      Vt_tenths,    4, 9999, Vf_ro,       "sensors co2",            "sensors_co2" },
+  { Var_3c_sensors_humidity, Vt_tenths,    4,  999, Vf_ro,       "sensors humidity",       "sensors_humidity" },
+  { Var_3f_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_40_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_41_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_42_party_level,      Vt_u8,        1,    0, Vf_rw,       "party level",            "party_level" },
+  { Var_43_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_44_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_45_zuluft_level,     Vt_u8,        1,    0, Vf_rw,       "zuluft level",           "zuluft_level" },
+  { Var_46_abluft_level,     Vt_u8,        1,    0, Vf_rw,       "abluft level",           "abluft_level" },
+  { Var_47_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_48_software_version, Vt_u16,       1,    0, Vf_ro,       "software version",       "software_version" },
+  { Var_49_nachlaufzeit,     Vt_u8,        1,    0, Vf_rw,       "nachlaufzeit",           "nachlaufzeit" },
+  { Var_4a_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_4b_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_4c_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_4d_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_4e_vacation_enabled, Vt_u8,        1,    0, Vf_rw,       "vacation enabled",       "vacation_enabled" },
+  { Var_4f_preheat_enabled,  Vt_u8,        1,    0, Vf_rw,       "preheating enabled",     "preheat_enabled" },
+  { Var_50_preheat_temp,     Vt_tenths,    1,    0, Vf_rw,       "preheating temperature", "preheat_temp" },
+  { Var_51_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_52_weekoffs_enabled, Vt_u8,        1,    0, Vf_rw,       "week offset enabled",    "weekoffs_enabled" },
+  { Var_54_quiet_curr_time,  Vt_u16,       1,    0, Vf_volatile, "quiet current time",     "quiet_curr_time" },
+  { Var_55_quiet_enabled,    Vt_u8,        1,    0, Vf_wo,       "quiet enabled",          "quiet_enabled" },
+  { Var_56_quiet_time,       Vt_u8,        1,    0, Vf_rw,       "quiet time",             "quiet_time" },
+  { Var_57_quiet_level,      Vt_u8,        1,    0, Vf_rw,       "quiet_level",            "quiet_level" },
+  { Var_58_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_59_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_5a_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_5b_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_5c_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_5d_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_5e_unknown,          Vt_raw,      26,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_5f_unknown,          Vt_u8,        1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_60_bypass2_temp,     Vt_u8,        1,    0, Vf_rw,       "bypass2 temperature",    "bypass2_temp" },
+  { Var_61_unknown,          Vt_raw,       3,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_62_unknown,          Vt_raw,       3,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_63_unknown,          Vt_raw,       3,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_64_unknown,          Vt_raw,       3,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_65_unknown,          Vt_u16,       1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_66_unknown,          Vt_u16,       1,    0, Vf_rw,       "unknown",                "unknown" },
+  { Var_67_unknown,          Vt_raw,       4,    0, Vf_rw,       "unknown",                "unknown" },
+};
+
+// Descriptors read with --vars, see read_var_overlay(). They take precedence
+// over var_descs.
+static Var_desc var_overlay[256];
+static char var_overlay_keys[256][24];
+static char var_overlay_names[256][40];
+
+static Var_desc const *get_builtin_var_desc(unsigned var)
+{
+  for (Var_desc const &d: var_descs)
+    if (d.idx == var)
+      return &d;
+    else if (d.idx > var)
+      break;
+  return nullptr;
+}
+
+static Var_desc const *get_var_desc(unsigned var)
+{
+  if (var < 256 && var_overlay[var].key)
+    return &var_overlay[var];
+  return get_builtin_var_desc(var);
+}
+
+// Variables carried by the status broadcast: the payload of a read is
+// taken from these broadcast bytes instead of spending a slot on it.
+struct Bcast_var
+{
+  uint8_t idx;
+  uint8_t len;
+  uint8_t offs[3];
+};
+
+static Bcast_var const bcast_vars[] =
+{
+  { Var_07_date_month_year, 3, { 3, 5, 6 } },
+  { Var_08_time_hour_min,   2, { 7, 8 } },
+  { Var_35_fan_level,       2, { 9, 10 } },
 };
 
+static bool in_broadcast(unsigned var)
+{
+  for (Bcast_var const &v: bcast_vars)
+    if (v.idx == var)
+      return true;
+  return false;
+}
+
+static char const *get_var_name(unsigned var)
+{
+  Var_desc const *d = get_var_desc(var);
+  return d ? d->name : "unknown";
+}
+
+static char const *const day_of_week[7] =
+{ "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+
 static int64_t get_time()
 {
   struct timespec now;
@@ -200,6 +359,14 @@ static int64_t get_time()
   return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
+// milliseconds since the epoch
+static int64_t get_wall_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 static USED void sleep_ms(long ms)
 {
   struct timespec t = { ms / 1000, ms * 1000000 };
@@ -262,823 +429,5110 @@ static void set_maxy(unsigned maxy, unsigned y = 0)
     }
 }
 
-static void signal_handler(int)
-{ _terminate = true; }
+// Text composed for a single write()
+class Line_buf
+{
+public:
+  void __attribute__((format(printf, 2, 3))) add(char const *fmt, ...)
+  {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(_s + _n, sizeof(_s) - _n, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+      _n += (unsigned)n < sizeof(_s) - _n ? n : sizeof(_s) - _n - 1;
+  }
 
-static int try_getchar()
+  char const *str() const
+  { return _s; }
+
+  unsigned len() const
+  { return _n; }
+
+private:
+  char     _s[640];
+  unsigned _n = 0;
+};
+
+// The status line lives in the last row, below the scroll region. Drawing
+// it saves the cursor, moves there and restores the cursor, so the cursor
+// never has to be asked for. After a window size change the scroll region
+// is moved first.
+static void begin_status(Line_buf &l)
+{
+  l.add("\0337");
+  if (_winch.exchange(false))
+    {
+      get_maxy(&_maxy);
+      l.add("\033[1;%ur", _maxy - 1);
+    }
+  l.add("\033[%u;1H", _maxy);
+}
+
+// One write() which is skipped if the terminal cannot take it right now,
+// the next status broadcast draws the line again.
+static void end_status(Line_buf &l)
+{
+  l.add("\033[K\0338");
+  struct pollfd p = { 1, POLLOUT, 0 };
+  fflush(stdout);
+  if (poll(&p, 1, 0) == 1)
+    write(1, l.str(), l.len());
+}
+
+// Run the calling thread under SCHED_FIFO, optionally pinned to one CPU,
+// with the process memory locked so that page faults cannot delay it.
+static bool setup_realtime(int cpu)
 {
-  char c = 0;
-  if (read(0, &c, 1) < 0)
-    perror ("read()");
-  return c;
+  int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+  flags |= MCL_ONFAULT; // don't populate the stacks of other threads
+#endif
+  if (mlockall(flags) < 0)
+    { perror("mlockall"); return false; }
+
+  // touch the stack we are going to use
+  volatile uint8_t stack[64 * 1024];
+  for (unsigned i = 0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+
+  if (cpu >= 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      if (err)
+        { errno = err; perror("pthread_setaffinity_np"); return false; }
+    }
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = 50;
+  int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (err)
+    { errno = err; perror("pthread_setschedparam"); return false; }
+
+  return true;
 }
 
-static bool peek_input(int *d1, int *d2, int *d3)
+static void signal_handler(int)
+{ _terminate = true; }
+
+static void winch_handler(int)
+{ _winch = true; }
+
+// Interactive mode: stdin without line buffering and echo for the whole
+// session. With VMIN = VTIME = 0 a read never waits; the event loop only
+// reads when there is input.
+static struct termios _term_restore;
+static bool _term_raw = false;
+
+static void term_raw()
 {
   struct termios term;
-  tcgetattr(0, &term);
-  struct termios restore = term;
+  if (tcgetattr(0, &term) < 0)
+    return; // not a terminal
+  _term_restore = term;
   term.c_lflag &= ~(ICANON|ECHO|ECHOE|ECHOCTL);
   term.c_cc[VMIN] = 0;
   term.c_cc[VTIME] = 0;
   tcsetattr(0, TCSANOW, &term);
-  *d2 = *d3 = 0;
-  if ((*d1 = try_getchar()) == '\033')
-    if ((*d2 = try_getchar()))
-      *d3 = try_getchar();
-  tcsetattr(0, TCSANOW, &restore);
-  return d1 != 0;
+  _term_raw = true;
 }
 
-class Paket
+static void term_restore()
+{
+  if (_term_raw)
+    tcsetattr(0, TCSANOW, &_term_restore);
+  _term_raw = false;
+}
+
+// Turns the bytes typed in interactive mode into keys. A terminal sends an
+// escape sequence with one write, so an ESC ending a read is the ESC key.
+class Key_decoder
 {
 public:
-  void new_paket(uint8_t const *buf, unsigned size)
+  enum { Key_none = 0, Key_esc = 0x100, Key_up, Key_down };
+
+  int feed(uint8_t c)
   {
-    _buf = buf;
-    _size = size;
-    if (_size >= 4 && _buf)
+    switch (_state)
       {
-        if (_size > 4U + buf[2])
-          _size = 4U + buf[2];
-        _is_valid = is_valid_checksum();
+      case Idle:
+        if (c != '\033')
+          return c;
+        _state = Esc;
+        return Key_none;
+
+      case Esc:
+        _state = c == '[' || c == 'O' ? Csi : Idle;
+        return Key_none; // Alt+key is ignored
+
+      case Csi:
+        if (c < 0x40 || c > 0x7e)
+          return Key_none; // parameters
+        _state = Idle;
+        return c == 'A' ? Key_up : c == 'B' ? Key_down : Key_none;
       }
-    else
-      _is_valid = false;
+    return Key_none;
   }
 
-  unsigned size() const
-  { return _size; }
+  // end of the bytes of one read
+  int end()
+  {
+    if (_state != Esc)
+      return Key_none;
+    _state = Idle;
+    return Key_esc;
+  }
 
-  uint8_t const *raw() const
-  { return _buf; }
+private:
+  enum { Idle, Esc, Csi } _state = Idle;
+};
 
-  uint8_t u8(unsigned i) const
-  { return i < _size ? _buf[4 + i] : 0; }
+// Machine-readable output: one JSON object per line or a sequence of CBOR
+// maps. Records are encoded into a fixed buffer without heap allocation or
+// printf and written to stdout in batches.
+class Encoder
+{
+public:
+  enum Format { Text, Jsonl, Cbor };
 
-  uint16_t u16(unsigned i) const
-  { return i + 4 + 2*i < _size ? *(uint16_t*)&_buf[4 + 2*i] : 0; }
+  void set_format(Format f)
+  { _format = f; }
 
-  uint32_t u32(unsigned i) const
-  { return i + 4 + 4*i < _size ? *(uint32_t*)&_buf[4 + 4*i] : 0; }
+  Format format() const
+  { return _format; }
 
-  uint8_t dsize() const
-  { return _buf[2]; }
+  // -1: keep everything in memory, see data()
+  void set_fd(int fd)
+  { _fd = fd; }
 
-  bool is_valid_checksum() const
+  void begin_record()
   {
-    uint8_t chksum = 0;
-    for (unsigned i = 0; i < _size - 1; ++i)
-      chksum += _buf[i];
-    chksum += 1;
-    return chksum == _buf[_size - 1];
+    if (_fd >= 0 && sizeof(_buf) - _len < Max_record)
+      flush();
+    _depth = 0;
+    begin(0xbf, '{');
   }
 
-  bool is_valid() const
-  { return _is_valid; }
+  void end_record()
+  {
+    end('}');
+    if (_format == Jsonl)
+      put('\n');
+  }
 
-  bool is_start_status() const
-  { return _buf[0] == 0xff && _buf[1] == 0xff; }
+  void begin_array()
+  {
+    value();
+    begin(0x9f, '[');
+  }
 
-  bool is_start_addr() const
-  { return _is_valid && _buf[0] >= 0x10 && _buf[0] <= 0x13; }
+  void end_array()
+  { end(']'); }
 
-  bool is_ping(uint8_t b0) const
-  { return _is_valid && _buf[0] == b0 && _buf[1] == 0 && dsize() == 0; }
+  void begin_map()
+  {
+    value();
+    begin(0xbf, '{');
+  }
 
-  bool is_status(uint8_t idx, uint8_t size) const
-  { return _is_valid && _buf[1] == 1 && dsize() == size && _buf[3] == idx; }
+  void end_map()
+  { end('}'); }
 
-  bool is_ack_10()
+  void key(char const *k)
   {
-    return _is_valid && _buf[0] == 0x10 && _buf[1] == 5
-                     && dsize() == 2 && _buf[4] == 0x55;
+    if (_format == Cbor)
+      cbor_str(k);
+    else
+      {
+        if (!_first[_depth])
+          put(',');
+        json_str(k);
+        put(':');
+      }
+    _first[_depth] = false;
+    _after_key = true;
   }
 
-  bool is_request(uint8_t idx)
-  { return _is_valid && _buf[1] == 0 && dsize() == 1 && _buf[3] == idx; }
-
-  bool is_fan_no_change()
+  void val_uint(uint64_t v)
   {
-    return _is_valid && _buf[1] == 1 && dsize() == 3
-        && _buf[3] == Var_35_fan_level && _buf[4] == 0xaa && _buf[5] == 0xbb;
+    value();
+    if (_format == Cbor)
+      cbor_head(0, v);
+    else
+      put_uint(v);
   }
 
-  // must also work if invalid
-  void print(char const *prefix, bool suppress_chksum) const
+  void val_int(int64_t v)
   {
-    printf("%s", prefix);
-    for (unsigned i = 0; i < _size - (unsigned)suppress_chksum; ++i)
+    if (v >= 0)
+      { val_uint(v); return; }
+    value();
+    if (_format == Cbor)
+      cbor_head(1, -1 - v);
+    else
       {
-        if (i == 4)
-          printf("[ ");
-        printf("%02x ", _buf[i]);
-        if (_size > 4 && i == _size - (unsigned)suppress_chksum - 1)
-          printf("]");
+        put('-');
+        put_uint(-(uint64_t)v);
       }
-    printf("\033[m\n");
   }
 
-  void print_got_temp() const
+  // fixed-point value in 10th
+  void val_tenths(int32_t v)
   {
-    printf("\033[32mtemp\033[m ");
-    for (unsigned i = 0; i < 10; ++i)
+    value();
+    if (_format == Cbor)
       {
-        uint16_t v = *(uint16_t *)(_buf + 4 + 2*i);
-        if (v != 9990)
-          printf("%d.%d°C ", v / 10, v % 10);
+        float f = v / 10.0f;
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        put(0xfa);
+        for (int s = 24; s >= 0; s -= 8)
+          put(u >> s);
+      }
+    else
+      {
+        if (v < 0)
+          {
+            put('-');
+            v = -v;
+          }
+        put_uint(v / 10);
+        put('.');
+        put('0' + v % 10);
       }
-    putchar('\n');
   }
 
-  void print_got_co2() const
+  void val_str(char const *s)
   {
-    printf("\033[32mCO₂\033[m ");
-    for (unsigned i = 0; i < 4; ++i)
-      {
-        uint16_t v = *(uint16_t *)(_buf + 4 + 2*i);
-        if (v != 9999)
-          printf("%d.%d ", v / 10, v% 10);
-      }
-    putchar('\n');
+    value();
+    if (_format == Cbor)
+      cbor_str(s);
+    else
+      json_str(s);
   }
 
-  void print_got_humidity() const
+  void val_bytes(uint8_t const *b, unsigned n)
   {
-    printf("\033[32mhumidity\033[m ");
-    for (unsigned i = 0; i < 4; ++i)
+    value();
+    if (_format == Cbor)
       {
-        uint16_t v = *(uint16_t *)(_buf + 4 + 2*i);
-        if (v != 999)
-          printf("%d.%d ", v / 10, v% 10);
+        cbor_head(2, n);
+        put_raw(b, n);
+      }
+    else
+      {
+        static char const hex[] = "0123456789abcdef";
+        put('"');
+        for (unsigned i = 0; i < n; ++i)
+          {
+            put(hex[b[i] >> 4]);
+            put(hex[b[i] & 0xf]);
+          }
+        put('"');
       }
-    putchar('\n');
   }
 
-  void print_status(uint16_t *temp, uint16_t bypass, uint16_t party,
-                    uint16_t quiet, bool at_bottom) const
+  void val_bool(bool b)
   {
-    if (_size != 27)
-      { printf("\033[31mwrong broadcast size\033[m %d\n", _size); return; }
+    value();
+    if (_format == Cbor)
+      put(b ? 0xf5 : 0xf4);
+    else
+      put_raw(b ? "true" : "false", b ? 4 : 5);
+  }
 
-    static char const *const day_of_week[7] =
-    { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
-    static char const *temp_symbol[4] = { "↓", "←", "↑", "→" };
-    static unsigned temp_idx[4] = { 0, 3, 1, 2 };
+  void val_null()
+  {
+    value();
+    if (_format == Cbor)
+      put(0xf6);
+    else
+      put_raw("null", 4);
+  }
 
-    static unsigned progress;
-    ++progress;
+  // encoded data not yet flushed, e.g. for sending it elsewhere
+  char const *data() const
+  { return (char const *)_buf; }
 
-    unsigned y;
-    if (at_bottom)
+  unsigned size() const
+  { return _len; }
+
+  void clear()
+  { _len = 0; }
+
+  // the workers and the bus thread share stdout; a batch is larger than
+  // PIPE_BUF, so batches must not interleave
+  void flush()
+  {
+    std::lock_guard<std::mutex> g(_output_lock);
+    for (unsigned off = 0; off < _len; )
       {
-        get_y(&y);
-        set_maxy(_maxy);
-        set_y(_maxy);
+        ssize_t ret = write(_fd, _buf + off, _len - off);
+        if (ret < 0 && errno == EINTR)
+          continue;
+        if (ret <= 0)
+          break;
+        off += ret;
       }
-    char prbuf[3] = { at_bottom ? ".oOo"[progress % 4] : '\0', ' ', '\0' };
-    printf("%s%s %02d.%02d.20%02d %d:%02d %s/%d ",
-           prbuf, _buf[4] < 7 ? day_of_week[_buf[4]] : "???",
-           _buf[3], _buf[5], _buf[6], _buf[7], _buf[8],
-           _buf[10] ? "\033[32mauto\033[m" : "\033[31mMANUAL\033[m", _buf[9]);
-    for (unsigned i = 0; i < 4; ++i)
-      if (temp[i] != 9990)
-        {
-          unsigned j = temp_idx[i];
-          printf("%s%d.%d°C ", temp_symbol[j], temp[j] / 10, temp[j] % 10);
-        }
-    if (bypass != 0xffff)
-      printf("bypass %u.%u°C ", bypass / 10, bypass % 10);
-    if (party != 0)
-      printf("\033[33mparty %dmin\033[m ", party);
-    if (quiet != 0)
-      printf("\033[33mquiet %dmin\033[m ", quiet);
+    _len = 0;
+  }
 
-#if 0
-    // print unknown data
-    printf("-- ");
-    for (unsigned i = 11; i < _size - 1; ++i)
-      printf("%02x ", _buf[i]);
-#endif
+  // flush between records once a batch is full
+  void flush_full()
+  {
+    if (_len >= Batch_size)
+      flush();
+  }
 
-    printf("\033[K");
-    if (at_bottom)
+  // flush if enough records were collected or the oldest is getting stale
+  void flush_batch(int64_t now)
+  {
+    if (_len >= Batch_size || (_len && now - _last_flush >= Batch_time))
       {
-        set_maxy(_maxy - 1, y);
-        fflush(stdout);
+        flush();
+        _last_flush = now;
       }
   }
 
 private:
-  uint8_t const *_buf = nullptr;
-  unsigned      _size = 0;
-  bool          _is_valid = false;
-};
+  enum
+  {
+    Max_record = 512,             // an encoded record never exceeds this
+    Batch_size = 4096,
+    Max_depth  = 4,
+  };
+  static constexpr int64_t Batch_time = 200000000; // 200ms
 
-class Kwl
-{
-public:
-  Kwl()
-  {}
+  void put(uint8_t c)
+  {
+    if (_len < sizeof(_buf))
+      _buf[_len++] = c;
+  }
 
-  ~Kwl()
+  void put_raw(void const *p, unsigned n)
   {
-    if (_sp >= 0)
-      close(_sp);
+    if (n > sizeof(_buf) - _len)
+      n = sizeof(_buf) - _len;
+    memcpy(_buf + _len, p, n);
+    _len += n;
   }
 
-  bool uart_open()
+  void put_uint(uint64_t v)
   {
-    _sp = open("/dev/" DEVICE, O_RDWR);
-    if (_sp < 0)
+    char tmp[20];
+    unsigned n = 0;
+    do
       {
-        perror("open");
-        return false;
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+      } while (v);
+    while (n)
+      put(tmp[--n]);
+  }
+
+  void json_str(char const *s)
+  {
+    put('"');
+    for (; *s; ++s)
+      {
+        if (*s == '"' || *s == '\\')
+          put('\\');
+        put(*s);
       }
-    return true;
+    put('"');
   }
 
-  bool uart_setup()
+  void cbor_head(uint8_t major, uint64_t v)
   {
-    struct termios tty;
-    memset(&tty, 0, sizeof(tty));
+    major <<= 5;
+    if (v < 24)
+      put(major | v);
+    else if (v < 0x100)
+      {
+        put(major | 24);
+        put(v);
+      }
+    else if (v < 0x10000)
+      {
+        put(major | 25);
+        put(v >> 8);
+        put(v);
+      }
+    else if (v < 0x100000000ULL)
+      {
+        put(major | 26);
+        for (int s = 24; s >= 0; s -= 8)
+          put(v >> s);
+      }
+    else
+      {
+        put(major | 27);
+        for (int s = 56; s >= 0; s -= 8)
+          put(v >> s);
+      }
+  }
 
-    if (tcgetattr(_sp, &tty) != 0)
-      { perror("tcgetattr"); return false; }
+  void cbor_str(char const *s)
+  {
+    unsigned n = strlen(s);
+    cbor_head(3, n);
+    put_raw(s, n);
+  }
+
+  // separator in front of an array element (map values follow their key)
+  void value()
+  {
+    if (_after_key)
+      _after_key = false;
+    else if (_format == Jsonl && _depth > 0 && !_first[_depth])
+      put(',');
+    _first[_depth] = false;
+  }
+
+  void begin(uint8_t cbor, char json)
+  {
+    put(_format == Cbor ? cbor : json);
+    if (_depth < Max_depth - 1)
+      ++_depth;
+    _first[_depth] = true;
+  }
+
+  void end(char json)
+  {
+    put(_format == Cbor ? 0xff : json);
+    if (_depth > 0)
+      --_depth;
+  }
+
+  uint8_t  _buf[Batch_size + Max_record];
+  unsigned _len = 0;
+  int64_t  _last_flush = 0;
+  Format   _format = Text;
+  int      _fd = 1;
+  unsigned _depth = 0;
+  bool     _first[Max_depth] = { true, };
+  bool     _after_key = false;
+
+  static std::mutex _output_lock;
+};
+
+static Encoder _enc;
+std::mutex Encoder::_output_lock;
+
+static void put_2digits(char *s, unsigned v)
+{
+  s[0] = '0' + v / 10 % 10;
+  s[1] = '0' + v % 10;
+}
+
+// Encode the payload of a variable according to its descriptor.
+static void encode_var(Encoder &e, Var_desc const *d,
+                       uint8_t const *data, unsigned len)
+{
+  if (!d)
+    {
+      e.val_bytes(data, len);
+      return;
+    }
+
+  char tmp[16];
+  switch (d->type)
+    {
+    case Vt_raw:
+      e.val_bytes(data, len);
+      break;
+
+    case Vt_date:
+      if (len < 3)
+        { e.val_null(); break; }
+      memcpy(tmp, "20yy-mm-dd", 11);
+      put_2digits(tmp + 2, data[2]);
+      put_2digits(tmp + 5, data[1]);
+      put_2digits(tmp + 8, data[0]);
+      e.val_str(tmp);
+      break;
+
+    case Vt_time:
+      if (len < 2)
+        { e.val_null(); break; }
+      memcpy(tmp, "hh:mm", 6);
+      put_2digits(tmp, data[0]);
+      put_2digits(tmp + 3, data[1]);
+      e.val_str(tmp);
+      break;
+
+    case Vt_calendar:
+      e.begin_array();
+      for (unsigned i = 3; i < len; ++i)
+        {
+          e.val_uint(data[i] & 0xf);
+          e.val_uint(data[i] >> 4);
+        }
+      e.end_array();
+      break;
+
+    default:
+      {
+        unsigned w = d->type == Vt_u8 ? 1 : d->type == Vt_u32 ? 4 : 2;
+        unsigned n = len / w < d->count ? len / w : d->count;
+        if (d->count > 1)
+          e.begin_array();
+        for (unsigned i = 0; i < n; ++i)
+          {
+            uint32_t v = 0;
+            for (unsigned b = 0; b < w; ++b)
+              v |= (uint32_t)data[i * w + b] << (8 * b);
+            if (d->invalid && v == d->invalid)
+              e.val_null();
+            else if (d->type == Vt_tenths)
+              e.val_tenths((int16_t)v);
+            else
+              e.val_uint(v);
+          }
+        if (d->count > 1)
+          e.end_array();
+        else if (n == 0)
+          e.val_null();
+      }
+      break;
+    }
+}
+
+// variable by its machine-readable key, or by its index as "0x1c"
+static Var_desc const *find_var_desc(char const *key)
+{
+  if (key[0] == '0' && key[1] == 'x')
+    {
+      char *end;
+      unsigned long idx = strtoul(key + 2, &end, 16);
+      return *end == '\0' && idx < 256 ? get_var_desc(idx) : nullptr;
+    }
+  for (Var_desc const &d: var_overlay)
+    if (d.key && !strcmp(d.key, key))
+      return &d;
+  for (Var_desc const &d: var_descs)
+    if (!strcmp(d.key, key) && strcmp(d.key, "unknown"))
+      return get_var_desc(d.idx);
+  return nullptr;
+}
+
+// counterpart of encode_var(): parse a value as written in a config file
+static bool parse_var(Var_desc const *d, char const *s,
+                      uint8_t *data, unsigned *len)
+{
+  char *end;
+  unsigned n = 0;
+  switch (d->type)
+    {
+    case Vt_date: // 20yy-mm-dd
+      {
+        unsigned y, m, day;
+        int pos = 0;
+        if (sscanf(s, "20%2u-%2u-%2u%n", &y, &m, &day, &pos) != 3
+            || s[pos] != '\0' || m < 1 || m > 12 || day < 1 || day > 31)
+          return false;
+        data[0] = day;
+        data[1] = m;
+        data[2] = y;
+        *len = 3;
+        return true;
+      }
+
+    case Vt_time: // hh:mm
+      {
+        unsigned h, m;
+        int pos = 0;
+        if (sscanf(s, "%2u:%2u%n", &h, &m, &pos) != 2
+            || s[pos] != '\0' || h > 23 || m > 59)
+          return false;
+        data[0] = h;
+        data[1] = m;
+        *len = 2;
+        return true;
+      }
+
+    case Vt_calendar: // 48 half-hour levels, blanks are ignored
+      memset(data, 0, 27);
+      for (; *s; ++s)
+        {
+          if (*s == ' ' || *s == '\t')
+            continue;
+          if (*s < '0' || *s > '4' || n == 48)
+            return false;
+          data[3 + n / 2] |= (*s - '0') << (4 * (n % 2));
+          ++n;
+        }
+      *len = 27;
+      return n == 48;
+
+    case Vt_raw: // hex bytes
+      for (; n < d->count; ++n)
+        {
+          while (*s == ' ' || *s == ',')
+            ++s;
+          unsigned long v = strtoul(s, &end, 16);
+          if (end == s || v > 0xff)
+            return false;
+          data[n] = v;
+          s = end;
+        }
+      *len = n;
+      return *s == '\0';
+
+    default: // comma-separated numbers
+      {
+        unsigned w = d->type == Vt_u8 ? 1 : d->type == Vt_u32 ? 4 : 2;
+        for (; n < d->count; ++n)
+          {
+            while (*s == ' ' || *s == ',')
+              ++s;
+            long v;
+            if (d->type == Vt_tenths)
+              {
+                // one decimal at most
+                double f = strtod(s, &end);
+                v = (long)(f * 10 + (f < 0 ? -0.5 : 0.5));
+                if (v < -32768 || v > 32767)
+                  return false;
+              }
+            else
+              {
+                v = strtol(s, &end, 0);
+                if (v < 0 || (w < 4 && v >= 1L << (8 * w)))
+                  return false;
+              }
+            if (end == s)
+              return false;
+            for (unsigned b = 0; b < w; ++b)
+              data[n * w + b] = (uint32_t)v >> (8 * b);
+            s = end;
+          }
+        *len = n * w;
+        return *s == '\0';
+      }
+    }
+}
+
+class Paket
+{
+public:
+  void new_paket(uint8_t const *buf, unsigned size)
+  {
+    _buf = buf;
+    _size = size;
+    if (_size >= 4 && _buf)
+      {
+        if (_size > 4U + buf[2])
+          _size = 4U + buf[2];
+        _is_valid = is_valid_checksum();
+      }
+    else
+      _is_valid = false;
+  }
+
+  unsigned size() const
+  { return _size; }
+
+  uint8_t const *raw() const
+  { return _buf; }
+
+  uint8_t u8(unsigned i) const
+  { return i < _size ? _buf[4 + i] : 0; }
+
+  uint16_t u16(unsigned i) const
+  { return i + 4 + 2*i < _size ? *(uint16_t*)&_buf[4 + 2*i] : 0; }
+
+  uint32_t u32(unsigned i) const
+  { return i + 4 + 4*i < _size ? *(uint32_t*)&_buf[4 + 4*i] : 0; }
+
+  uint8_t dsize() const
+  { return _buf[2]; }
+
+  bool is_valid_checksum() const
+  {
+    uint8_t chksum = 0;
+    for (unsigned i = 0; i < _size - 1; ++i)
+      chksum += _buf[i];
+    chksum += 1;
+    return chksum == _buf[_size - 1];
+  }
+
+  bool is_valid() const
+  { return _is_valid; }
+
+  bool is_start_status() const
+  { return _buf[0] == 0xff && _buf[1] == 0xff; }
+
+  bool is_start_addr() const
+  { return _is_valid && _buf[0] >= 0x10 && _buf[0] <= 0x13; }
+
+  bool is_ping(uint8_t b0) const
+  { return _is_valid && _buf[0] == b0 && _buf[1] == 0 && dsize() == 0; }
+
+  bool is_status(uint8_t idx, uint8_t size) const
+  { return _is_valid && _buf[1] == 1 && dsize() == size && _buf[3] == idx; }
+
+  bool is_ack_10() const
+  {
+    return _is_valid && _buf[0] == 0x10 && _buf[1] == 5
+                     && dsize() == 2 && _buf[4] == 0x55;
+  }
+
+  bool is_request(uint8_t idx) const
+  { return _is_valid && _buf[1] == 0 && dsize() == 1 && _buf[3] == idx; }
+
+  bool is_fan_no_change() const
+  {
+    return _is_valid && _buf[1] == 1 && dsize() == 3
+        && _buf[3] == Var_35_fan_level && _buf[4] == 0xaa && _buf[5] == 0xbb;
+  }
+
+  // must also work if invalid
+  void print(char const *prefix, bool suppress_chksum) const
+  {
+    printf("%s", prefix);
+    for (unsigned i = 0; i < _size - (unsigned)suppress_chksum; ++i)
+      {
+        if (i == 4)
+          printf("[ ");
+        printf("%02x ", _buf[i]);
+        if (_size > 4 && i == _size - (unsigned)suppress_chksum - 1)
+          printf("]");
+      }
+    printf("\033[m\n");
+  }
+
+  void print_got_temp() const
+  {
+    printf("\033[32mtemp\033[m ");
+    for (unsigned i = 0; i < 10; ++i)
+      {
+        uint16_t v = *(uint16_t *)(_buf + 4 + 2*i);
+        if (v != 9990)
+          printf("%d.%d°C ", v / 10, v % 10);
+      }
+    putchar('\n');
+  }
+
+  void print_got_co2() const
+  {
+    printf("\033[32mCO₂\033[m ");
+    for (unsigned i = 0; i < 4; ++i)
+      {
+        uint16_t v = *(uint16_t *)(_buf + 4 + 2*i);
+        if (v != 9999)
+          printf("%d.%d ", v / 10, v% 10);
+      }
+    putchar('\n');
+  }
+
+  void print_got_humidity() const
+  {
+    printf("\033[32mhumidity\033[m ");
+    for (unsigned i = 0; i < 4; ++i)
+      {
+        uint16_t v = *(uint16_t *)(_buf + 4 + 2*i);
+        if (v != 999)
+          printf("%d.%d ", v / 10, v% 10);
+      }
+    putchar('\n');
+  }
+
+  void print_status(uint16_t *temp, uint16_t bypass, uint16_t party,
+                    uint16_t quiet, bool at_bottom) const
+  {
+    if (_size != 27)
+      { printf("\033[31mwrong broadcast size\033[m %d\n", _size); return; }
+
+    static char const *temp_symbol[4] = { "↓", "←", "↑", "→" };
+    static unsigned temp_idx[4] = { 0, 3, 1, 2 };
+
+    static unsigned progress;
+    ++progress;
+
+    Line_buf l;
+    if (at_bottom)
+      begin_status(l);
+    char prbuf[3] = { at_bottom ? ".oOo"[progress % 4] : '\0', ' ', '\0' };
+    l.add("%s%s %02d.%02d.20%02d %d:%02d %s/%d ",
+          prbuf, _buf[4] < 7 ? day_of_week[_buf[4]] : "???",
+          _buf[3], _buf[5], _buf[6], _buf[7], _buf[8],
+          _buf[10] ? "\033[32mauto\033[m" : "\033[31mMANUAL\033[m", _buf[9]);
+    for (unsigned i = 0; i < 4; ++i)
+      if (temp[i] != 9990)
+        {
+          unsigned j = temp_idx[i];
+          l.add("%s%d.%d°C ", temp_symbol[j], temp[j] / 10, temp[j] % 10);
+        }
+    if (bypass != 0xffff)
+      l.add("bypass %u.%u°C ", bypass / 10, bypass % 10);
+    if (party != 0)
+      l.add("\033[33mparty %dmin\033[m ", party);
+    if (quiet != 0)
+      l.add("\033[33mquiet %dmin\033[m ", quiet);
+
+    if (at_bottom)
+      end_status(l);
+    else
+      printf("%s\033[K", l.str());
+  }
+
+private:
+  uint8_t const *_buf = nullptr;
+  unsigned      _size = 0;
+  bool          _is_valid = false;
+};
+
+// Last value seen on the bus for each variable and for the status
+// broadcast. Only the bus loop writes; other threads get a consistent copy
+// of an entry without ever blocking the writer (sequence lock).
+class Var_cache
+{
+public:
+  enum
+  {
+    Status   = 0x100,             // payload of the status broadcast
+    Max_data = 32,
+  };
+
+  struct Entry
+  {
+    int64_t time;                 // get_time() of the update, 0 = never seen
+    uint8_t len;
+    uint8_t data[Max_data];
+
+    uint16_t u16(unsigned i) const
+    { return 2*i + 1 < len ? data[2*i] | (data[2*i + 1] << 8) : 0; }
+
+    uint32_t u32(unsigned i) const
+    { return 4*i + 3 < len ? u16(2*i) | ((uint32_t)u16(2*i + 1) << 16) : 0; }
+  };
+
+  void store(unsigned idx, uint8_t const *data, unsigned len, int64_t time)
+  {
+    Slot &s = _slots[idx];
+    unsigned seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (len > Max_data)
+      len = Max_data;
+    memcpy(s.e.data, data, len);
+    s.e.len = len;
+    s.e.time = time;
+    s.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  // return false if the variable was never seen
+  bool load(unsigned idx, Entry *e) const
+  {
+    Slot const &s = _slots[idx];
+    for (;;)
+      {
+        unsigned seq = s.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+          continue;
+        memcpy(e, &s.e, sizeof(*e));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load(std::memory_order_relaxed) == seq)
+          return e->time != 0;
+      }
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<unsigned> seq{0};
+    Entry e = { 0, 0, { 0, } };
+  };
+
+  Slot _slots[Status + 1];
+};
+
+// Bus traffic counters. Updated by the bus loop only and readable from
+// other threads at any time.
+class Bus_stats
+{
+public:
+  enum Counter
+  {
+    Rx_bytes,                     // all received bytes
+    Frames,                       // valid frames
+    Bad_checksum,                 // ignored frames
+    Overflows,                    // receive buffer overflows
+    Unknown,                      // frames from unknown addresses
+    Our_slots,                    // polls of our address
+    Prestaged,                    // ... with the answer already prepared
+    Deadline_misses,              // answers sent too late
+    Dropped,                      // frames not rendered, workers too slow
+    Harvested,                    // values taken from other panels' traffic
+    Reads_saved,                  // reads not sent, the value was fresh
+    Num_counters
+  };
+
+  enum
+  {
+    First_poll = 0x10,            // remote control addresses polled by the master
+    Num_polls  = 4,
+    Num_bins   = 16,              // bin i: interval < 2^(i+1) ms
+  };
+
+  Bus_stats()
+  : _start(get_time())
+  {}
+
+  void inc(Counter c)
+  { inc(_counters[c]); }
+
+  void frame(uint8_t addr)
+  {
+    inc(_counters[Frames]);
+    inc(_frames[addr]);
+  }
+
+  void poll(uint8_t addr, int64_t now)
+  {
+    unsigned a = addr - First_poll;
+    if (a >= Num_polls)
+      return;
+    if (_last_poll[a])
+      {
+        uint64_t ms = (now - _last_poll[a]) / 1000000;
+        unsigned bin = 0;
+        while (ms > 1 && bin < Num_bins - 1)
+          {
+            ms >>= 1;
+            ++bin;
+          }
+        inc(_poll_hist[a][bin]);
+      }
+    _last_poll[a] = now;
+  }
+
+  // time from the poll until our answer was written
+  void reply(int64_t latency, int64_t deadline)
+  {
+    uint32_t us = latency / 1000;
+    if (us > _max_reply_us.load(std::memory_order_relaxed))
+      _max_reply_us.store(us, std::memory_order_relaxed);
+    if (latency > deadline)
+      inc(_counters[Deadline_misses]);
+  }
+
+  uint32_t get(Counter c) const
+  { return _counters[c].load(std::memory_order_relaxed); }
+
+  uint32_t max_reply_us() const
+  { return _max_reply_us.load(std::memory_order_relaxed); }
+
+  uint32_t frames(uint8_t addr) const
+  { return _frames[addr].load(std::memory_order_relaxed); }
+
+  uint32_t poll_hist(unsigned a, unsigned bin) const
+  { return _poll_hist[a][bin].load(std::memory_order_relaxed); }
+
+  // --extra-slots: requests sent in the slot of another address, and the
+  // answers of the master to them
+  void borrowed(uint8_t addr, bool answer)
+  {
+    unsigned a = addr - First_poll;
+    if (a < Num_polls)
+      inc(_borrowed[a][answer]);
+  }
+
+  uint32_t borrowed(unsigned a, bool answers) const
+  { return _borrowed[a][answers].load(std::memory_order_relaxed); }
+
+  // seconds since start
+  double elapsed() const
+  { return (get_time() - _start) / 1e9; }
+
+  // percentage of time the bus was busy (8N1 at 19200 baud)
+  double utilisation() const
+  {
+    double t = elapsed();
+    return t > 0 ? get(Rx_bytes) * 10 / 19200.0 / t * 100 : 0;
+  }
+
+private:
+  typedef std::atomic<uint32_t> Cnt;
+
+  // single writer: no need for a locked read-modify-write
+  static void inc(Cnt &c)
+  { c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+  Cnt     _counters[Num_counters] = {};
+  Cnt     _max_reply_us{0};
+  Cnt     _frames[256] = {};
+  Cnt     _poll_hist[Num_polls][Num_bins] = {};
+  Cnt     _borrowed[Num_polls][2] = {};
+  int64_t _last_poll[Num_polls] = { 0, };
+  int64_t _start;
+};
+
+// unit is only shown if not null
+static void print_stats(Bus_stats const &s, char const *unit)
+{
+  double t = s.elapsed();
+  printf("\033[1mbus statistics%s%s\033[m (%.0fs)\n",
+         unit ? " " : "", unit ? unit : "", t);
+  printf("  bytes %u, utilisation %.1f%%\n",
+         s.get(Bus_stats::Rx_bytes), s.utilisation());
+  printf("  frames %u, checksum errors %u, buffer overflows %u, unknown %u\n",
+         s.get(Bus_stats::Frames), s.get(Bus_stats::Bad_checksum),
+         s.get(Bus_stats::Overflows), s.get(Bus_stats::Unknown));
+  printf("  our slots %u, answer prepared in advance %u\n",
+         s.get(Bus_stats::Our_slots), s.get(Bus_stats::Prestaged));
+  printf("  reply deadline misses %u, max reply latency %u.%03ums\n",
+         s.get(Bus_stats::Deadline_misses),
+         s.max_reply_us() / 1000, s.max_reply_us() % 1000);
+  if (s.get(Bus_stats::Dropped))
+    printf("  frames dropped by the workers %u\n", s.get(Bus_stats::Dropped));
+  printf("  values from other panels %u, reads saved %u\n",
+         s.get(Bus_stats::Harvested), s.get(Bus_stats::Reads_saved));
+  printf("  heap allocations %u, thereof in the loop %u\n",
+         _heap_allocs.load(std::memory_order_relaxed), heap_allocs_in_loop());
+  printf("  addr    frames  per min\n");
+  for (unsigned a = 0; a < 256; ++a)
+    if (s.frames(a))
+      printf("  0x%02x %9u %8.1f\n", a, s.frames(a), s.frames(a) * 60 / t);
+  printf("  poll interval (ms) ");
+  for (unsigned b = 0; b < Bus_stats::Num_bins; ++b)
+    printf("%6u", 2U << b);
+  putchar('\n');
+  for (unsigned a = 0; a < Bus_stats::Num_polls; ++a)
+    {
+      printf("  0x%02x              ", Bus_stats::First_poll + a);
+      for (unsigned b = 0; b < Bus_stats::Num_bins; ++b)
+        printf("%6u", s.poll_hist(a, b));
+      putchar('\n');
+    }
+  for (unsigned a = 0; a < Bus_stats::Num_polls; ++a)
+    if (s.borrowed(a, false))
+      printf("  slot 0x%02x used for %u requests, %u answered\n",
+             Bus_stats::First_poll + a, s.borrowed(a, false),
+             s.borrowed(a, true));
+}
+
+static void encode_stats(Encoder &e, Bus_stats const &s, char const *unit)
+{
+  char key[8];
+  e.begin_record();
+  if (unit)
+    {
+      e.key("unit");
+      e.val_str(unit);
+    }
+  e.key("elapsed_s");
+  e.val_uint(s.elapsed());
+  e.key("rx_bytes");
+  e.val_uint(s.get(Bus_stats::Rx_bytes));
+  e.key("utilisation_pct");
+  e.val_tenths((int32_t)(s.utilisation() * 10));
+  e.key("frames");
+  e.val_uint(s.get(Bus_stats::Frames));
+  e.key("bad_checksum");
+  e.val_uint(s.get(Bus_stats::Bad_checksum));
+  e.key("overflows");
+  e.val_uint(s.get(Bus_stats::Overflows));
+  e.key("unknown");
+  e.val_uint(s.get(Bus_stats::Unknown));
+  e.key("our_slots");
+  e.val_uint(s.get(Bus_stats::Our_slots));
+  e.key("prestaged");
+  e.val_uint(s.get(Bus_stats::Prestaged));
+  e.key("deadline_misses");
+  e.val_uint(s.get(Bus_stats::Deadline_misses));
+  e.key("max_reply_us");
+  e.val_uint(s.max_reply_us());
+  e.key("dropped");
+  e.val_uint(s.get(Bus_stats::Dropped));
+  e.key("harvested");
+  e.val_uint(s.get(Bus_stats::Harvested));
+  e.key("reads_saved");
+  e.val_uint(s.get(Bus_stats::Reads_saved));
+  e.key("heap_allocs");
+  e.val_uint(_heap_allocs.load(std::memory_order_relaxed));
+  e.key("heap_allocs_in_loop");
+  e.val_uint(heap_allocs_in_loop());
+  e.key("frames_by_addr");
+  e.begin_map();
+  for (unsigned a = 0; a < 256; ++a)
+    if (s.frames(a))
+      {
+        snprintf(key, sizeof(key), "0x%02x", a);
+        e.key(key);
+        e.val_uint(s.frames(a));
+      }
+  e.end_map();
+  e.key("poll_interval_ms_log2");
+  e.begin_map();
+  for (unsigned a = 0; a < Bus_stats::Num_polls; ++a)
+    {
+      snprintf(key, sizeof(key), "0x%02x", Bus_stats::First_poll + a);
+      e.key(key);
+      e.begin_array();
+      for (unsigned b = 0; b < Bus_stats::Num_bins; ++b)
+        e.val_uint(s.poll_hist(a, b));
+      e.end_array();
+    }
+  e.end_map();
+  e.key("borrowed_slots");
+  e.begin_map();
+  for (unsigned a = 0; a < Bus_stats::Num_polls; ++a)
+    if (s.borrowed(a, false))
+      {
+        snprintf(key, sizeof(key), "0x%02x", Bus_stats::First_poll + a);
+        e.key(key);
+        e.begin_array();
+        e.val_uint(s.borrowed(a, false));
+        e.val_uint(s.borrowed(a, true));
+        e.end_array();
+      }
+  e.end_map();
+  e.end_record();
+}
+
+// Model of the master's polling cycle. The master polls the remote control
+// addresses and other peripherals in a fixed order; learn which ping
+// precedes ours and the cycle period to know when our poll is due.
+class Poll_schedule
+{
+public:
+  enum { Our_addr = 0x13 };
+
+  // a ping of addr ended at time t
+  void ping(uint8_t addr, int64_t t)
+  {
+    if (addr == Our_addr)
+      {
+        if (_last_ours)
+          _period = avg(_period, t - _last_ours);
+        if (_prev == _pred)
+          {
+            if (_confidence < Confident)
+              ++_confidence;
+          }
+        else
+          {
+            _pred = _prev;
+            _confidence = 0;
+          }
+        _last_ours = t;
+      }
+    _prev = addr;
+  }
+
+  // our poll is expected to be the next frame
+  bool imminent(int64_t now) const
+  {
+    if (_confidence >= Confident)
+      return _prev == _pred;
+    return _period && now >= _last_ours + _period - Margin;
+  }
+
+  int64_t period() const
+  { return _period; }
+
+private:
+  enum { Confident = 3 };
+  static constexpr int64_t Margin = 100000000; // 100ms
+
+  static int64_t avg(int64_t a, int64_t v)
+  { return a ? a + (v - a) / 8 : v; }
+
+  int64_t _period = 0;
+  int64_t _last_ours = 0;
+  int     _prev = -1;             // last ping seen
+  int     _pred = -1;             // ping directly preceding ours
+  unsigned _confidence = 0;
+};
+
+// Remote panel addresses 0x10..0x12 whose polls nobody answers, lent to
+// queued requests with --extra-slots. An address is free after Free_polls
+// of its polls in a row went unanswered. It is given back as soon as
+// another device answers a poll, or when the master stopped answering our
+// requests there (a panel talking at the same time).
+class Extra_slots
+{
+public:
+  enum { First = 0x10, Num = 3, Free_polls = 8, Max_misses = 3 };
+  enum Op { None = -1, Read = 0, Write = 1 };
+
+  // a poll of addr, op is what we sent in its slot
+  void poll(uint8_t addr, Op op)
+  {
+    settle();
+    _polled = addr >= First && addr < First + Num ? addr - First : -1;
+    _op = op;
+    _answered = false;
+    _got = false;
+  }
+
+  // a frame after the poll, return true if it answers our request
+  bool frame(uint8_t const *buf, unsigned dsize)
+  {
+    if (_polled < 0)
+      return false;
+    if (_op == None)
+      {
+        if (buf[0] == First + _polled && buf[1] <= 1 && dsize >= 1)
+          _answered = true; // a device of this address
+        return false;
+      }
+    // the echo of a write looks like a value, only the ack counts then
+    if (_got || buf[1] != (_op == Write ? 5 : 1))
+      return false;
+    _got = true;
+    return true;
+  }
+
+  bool free(uint8_t addr) const
+  {
+    unsigned a = addr - First;
+    return a < Num && _unanswered[a] >= Free_polls;
+  }
+
+  int polled() const
+  { return _polled < 0 ? -1 : First + _polled; }
+
+private:
+  void settle()
+  {
+    if (_polled < 0)
+      return;
+    unsigned &n = _unanswered[_polled];
+    if (_answered)
+      n = 0;
+    else if (_op == None)
+      n += n < Free_polls;
+    else if (_got)
+      _misses[_polled] = 0;
+    else if (++_misses[_polled] >= Max_misses)
+      {
+        n = 0;
+        _misses[_polled] = 0;
+      }
+  }
+
+  int      _polled = -1;          // index of the address polled last
+  Op       _op = None;
+  bool     _answered = false;     // by another device
+  bool     _got = false;          // the master answered our request
+  unsigned _unanswered[Num] = { 0, };
+  unsigned _misses[Num] = { 0, };
+};
+
+// Reads and writes of a unit waiting for a slot, one is sent per slot.
+class Request_queue
+{
+public:
+  struct Request
+  {
+    bool    write;
+    uint8_t idx;
+    uint8_t len;
+    uint8_t data[Var_cache::Max_data];
+  };
+
+  bool read(uint8_t idx)
+  { return push(false, idx, nullptr, 0); }
+
+  bool write(uint8_t idx, uint8_t const *data, unsigned len)
+  { return push(true, idx, data, len); }
+
+  bool empty() const
+  { return _head == _tail; }
+
+  Request const &front() const
+  { return _ring[_head % Size]; }
+
+  void pop()
+  { ++_head; }
+
+private:
+  bool push(bool write, uint8_t idx, uint8_t const *data, unsigned len)
+  {
+    if (_tail - _head == Size || len > Var_cache::Max_data)
+      return false;
+    Request &r = _ring[_tail++ % Size];
+    r.write = write;
+    r.idx = idx;
+    r.len = len;
+    if (len)
+      memcpy(r.data, data, len);
+    return true;
+  }
+
+  static constexpr unsigned Size = 128;
+  Request  _ring[Size];
+  unsigned _head = 0;
+  unsigned _tail = 0;
+};
+
+// A command for the bus loop of a unit. Settings of the command line,
+// keys and HTTP clients all arrive this way.
+struct Command
+{
+  enum Type : uint8_t
+  {
+    Set_time,                     // value: hour + (minutes << 8)
+    Set_bypass,                   // value: °C, 0xffff toggles
+    Set_fan,                      // value: 0xaa auto, 0x100 | level manual
+    Fan_step,                     // value: +1 up, -1 down
+    Set_party,                    // value: minutes, 0xaa00 off, 0xaa01 on
+    Set_quiet,                    // value: minutes, 0xaa00 off, 0xaa01 on
+    Set_voltage,                  // value: level + (voltages << 16)
+    Write,                        // data to idx, see Write_box
+    Read,                         // idx into the cache
+  };
+
+  Type     type;
+  uint8_t  idx;
+  uint8_t  len;
+  int32_t  value;
+  unsigned gen;                   // Write: ticket of the producer
+  uint8_t  data[Var_cache::Max_data];
+};
+
+// Bounded queue of commands: any thread pushes, only the bus loop pops.
+// Lock-free, every cell carries a sequence number telling whether it is
+// free for the producer at a position or filled for the consumer.
+class Command_queue
+{
+public:
+  enum { Size = 64 };              // power of 2
+
+  Command_queue()
+  {
+    for (unsigned i = 0; i < Size; ++i)
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // false if the queue is full
+  bool push(Command const &c)
+  {
+    unsigned pos = _tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;)
+      {
+        cell = &_cells[pos % Size];
+        unsigned seq = cell->seq.load(std::memory_order_acquire);
+        int diff = (int)(seq - pos);
+        if (diff == 0)
+          {
+            if (_tail.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed))
+              break;
+          }
+        else if (diff < 0)
+          return false;
+        else
+          pos = _tail.load(std::memory_order_relaxed);
+      }
+    cell->cmd = c;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // bus loop only
+  bool pop(Command *c)
+  {
+    Cell &cell = _cells[_head % Size];
+    if (cell.seq.load(std::memory_order_acquire) != _head + 1)
+      return false;
+    *c = cell.cmd;
+    cell.seq.store(_head + Size, std::memory_order_release);
+    ++_head;
+    return true;
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<unsigned> seq;
+    Command cmd;
+  };
+
+  Cell _cells[Size];
+  std::atomic<unsigned> _tail{0};
+  unsigned _head = 0;
+};
+
+// Writes of other threads (HTTP /set) until the bus loop sends them. The
+// producer draws a ticket and queues a Write command with it. A write of a
+// variable which has not gone out yet is replaced by one with a later
+// ticket (last writer wins), and all callers learn the outcome of the
+// write finally sent. Only the bus loop touches the pending values; the
+// outcome is published with atomics.
+class Write_box
+{
+public:
+  enum Result { Pending, Done, Failed };
+
+  struct Write
+  {
+    uint8_t  idx;
+    uint8_t  len;
+    uint8_t  data[Var_cache::Max_data];
+    unsigned gen;
+    bool     pre_done;            // the step before the value was acked
+  };
+
+  struct Ticket
+  {
+    uint8_t  idx;
+    unsigned gen;
+  };
+
+  // any thread
+  Ticket ticket(uint8_t idx)
+  { return { idx, _tickets[idx].fetch_add(1, std::memory_order_relaxed) + 1 }; }
+
+  // any thread
+  Result result(Ticket t) const
+  {
+    Var const &v = _vars[t.idx];
+    if (t.gen <= v.done.load(std::memory_order_acquire))
+      return Done;
+    if (t.gen <= v.failed.load(std::memory_order_acquire))
+      return Failed;
+    return Pending;
+  }
+
+  // bus loop: a Write command arrived
+  void put(uint8_t idx, uint8_t const *data, unsigned len, unsigned gen)
+  {
+    Var &v = _vars[idx];
+    if (gen <= v.gen)
+      return; // overtaken by a later ticket already
+    if (len > Var_cache::Max_data)
+      len = Var_cache::Max_data;
+    memcpy(v.data, data, len);
+    v.len = len;
+    v.gen = gen;
+  }
+
+  // bus loop: the write for the next slot, confirm it with sent()
+  bool next(int64_t now, Write *w)
+  {
+    for (unsigned i = 0; i < 256; ++i)
+      {
+        Var &v = _vars[i];
+        if (v.gen > v.sent)
+          {
+            w->gen = v.gen;
+            w->len = v.len;
+            memcpy(w->data, v.data, v.len);
+            w->pre_done = false;
+          }
+        else if (!in_flight(v))
+          continue;
+        else if (v.pre == Pre_acked)
+          {
+            // the value follows its step at once
+            w->gen = v.sent;
+            w->len = v.sent_len;
+            memcpy(w->data, v.sent_data, v.sent_len);
+            w->pre_done = true;
+          }
+        else if (now - v.time < Retry)
+          continue;
+        else if (v.tries >= Max_tries)
+          {
+            v.failed.store(v.sent, std::memory_order_release);
+            continue;
+          }
+        else
+          {
+            w->gen = v.sent;
+            w->len = v.sent_len;
+            memcpy(w->data, v.sent_data, v.sent_len);
+            w->pre_done = false;
+          }
+        w->idx = i;
+        return true;
+      }
+    return false;
+  }
+
+  // bus loop: pre if only a step needed before the value was sent, e.g.
+  // the fan mode before a level; it counts as a try of the write
+  void sent(Write const &w, int64_t now, bool pre = false)
+  {
+    Var &v = _vars[w.idx];
+    if (w.gen != v.sent)
+      v.tries = 0;
+    v.sent = w.gen;
+    v.sent_len = w.len;
+    memcpy(v.sent_data, w.data, w.len);
+    v.time = now;
+    v.pre = pre ? Pre_sent : Pre_none;
+    ++v.tries;
+  }
+
+  // bus loop: the master acknowledged a write of ours
+  void acked(uint8_t idx, uint8_t const *data, unsigned len)
+  {
+    Var &v = _vars[idx];
+    if (!in_flight(v))
+      return;
+    if (len == v.sent_len && !memcmp(data, v.sent_data, len))
+      v.done.store(v.sent, std::memory_order_release);
+    else if (v.pre == Pre_sent)
+      v.pre = Pre_acked;
+  }
+
+private:
+  static constexpr int64_t Retry = 2000000000LL; // no ack
+  static constexpr unsigned Max_tries = 3;
+
+  enum Pre : uint8_t { Pre_none, Pre_sent, Pre_acked };
+
+  struct Var
+  {
+    unsigned gen = 0;             // of the pending value
+    unsigned sent = 0;            // gen on the bus
+    std::atomic<unsigned> done{0};
+    std::atomic<unsigned> failed{0};
+    unsigned tries = 0;
+    Pre      pre = Pre_none;      // step before the value
+    int64_t  time = 0;            // sent
+    uint8_t  len = 0;
+    uint8_t  sent_len = 0;
+    uint8_t  data[Var_cache::Max_data];
+    uint8_t  sent_data[Var_cache::Max_data];
+  };
+
+  bool in_flight(Var const &v) const
+  {
+    return    v.sent > v.done.load(std::memory_order_relaxed)
+           && v.sent > v.failed.load(std::memory_order_relaxed);
+  }
+
+  std::atomic<unsigned> _tickets[256] = {};
+  Var _vars[256];
+};
+
+// Background reads in free slots. Each variable is read again after its
+// period, which is halved when the value changed since the last time and
+// grows by half when it did not, within [min, max]. Values which came
+// from other panels or the broadcast count like our own reads. The
+// variable with the earliest deadline goes first.
+class Read_schedule
+{
+public:
+  enum { Max_vars = 16 };
+
+  void add(uint8_t idx, int64_t min, int64_t max)
+  {
+    for (unsigned i = 0; i < _num; ++i)
+      if (_vars[i].idx == idx)
+        return;
+    if (_num == Max_vars)
+      return;
+    Var &v = _vars[_num++];
+    v.idx = idx;
+    v.min = min;
+    v.max = max;
+    v.period = min;
+  }
+
+  // the variable to read now, -1 if none is due; a value which came
+  // without our read, e.g. from another panel, counts as a read saved
+  int next(Var_cache const &cache, int64_t now, Bus_stats &stats)
+  {
+    Var *best = nullptr;
+    for (unsigned i = 0; i < _num; ++i)
+      {
+        Var &v = _vars[i];
+        Var_cache::Entry e;
+        if (cache.load(v.idx, &e) && e.time > v.seen)
+          {
+            if (!v.asked)
+              stats.inc(Bus_stats::Reads_saved);
+            seen(v, e);
+          }
+        if (v.due <= now && (!best || v.due < best->due))
+          best = &v;
+      }
+    if (!best)
+      return -1;
+    best->due = now + Retry; // unless the answer comes earlier
+    best->asked = true;
+    return best->idx;
+  }
+
+private:
+  static constexpr int64_t Retry = 2000000000LL; // the answer was lost
+
+  struct Var
+  {
+    uint8_t idx;
+    uint8_t len = 0;
+    uint8_t data[Var_cache::Max_data];
+    int64_t min, max;
+    int64_t period;
+    int64_t seen = 0;             // time of the value in data
+    int64_t due = 0;
+    bool    asked = false;        // read sent, no value since
+  };
+
+  static void seen(Var &v, Var_cache::Entry const &e)
+  {
+    if (!v.seen)
+      ;
+    else if (e.len != v.len || memcmp(e.data, v.data, e.len))
+      v.period = v.period / 2 > v.min ? v.period / 2 : v.min;
+    else
+      v.period = v.period + v.period / 2 < v.max ? v.period + v.period / 2
+                                                 : v.max;
+    v.len = e.len;
+    memcpy(v.data, e.data, e.len);
+    v.seen = e.time;
+    v.due = e.time + v.period;
+    v.asked = false;
+  }
+
+  Var      _vars[Max_vars];
+  unsigned _num = 0;
+};
+
+// Raw payloads of a unit's variables as saved by --dump. File format:
+// "KWLS", version, then index, length and payload of each variable.
+class Snapshot
+{
+public:
+  void set(uint8_t idx, uint8_t const *data, unsigned len)
+  {
+    if (len > Var_cache::Max_data)
+      len = Var_cache::Max_data;
+    memcpy(_data[idx], data, len);
+    _len[idx] = len;
+  }
+
+  // 0 if not part of the snapshot
+  unsigned len(uint8_t idx) const
+  { return _len[idx]; }
+
+  uint8_t const *data(uint8_t idx) const
+  { return _data[idx]; }
+
+  bool save(char const *file) const
+  {
+    uint8_t buf[6 + 256 * (2 + Var_cache::Max_data)];
+    unsigned n = 0;
+    memcpy(buf, Magic, 4);
+    buf[4] = Version;
+    n = 5;
+    for (unsigned i = 0; i < 256; ++i)
+      if (_len[i])
+        {
+          buf[n++] = i;
+          buf[n++] = _len[i];
+          memcpy(buf + n, _data[i], _len[i]);
+          n += _len[i];
+        }
+
+    int fd = open(file, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+      { perror(file); return false; }
+    bool ok = write(fd, buf, n) == (ssize_t)n;
+    if (!ok)
+      perror(file);
+    close(fd);
+    return ok;
+  }
+
+  bool load(char const *file)
+  {
+    uint8_t buf[6 + 256 * (2 + Var_cache::Max_data)];
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      { perror(file); return false; }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n < 5 || memcmp(buf, Magic, 4) || buf[4] != Version)
+      { printf("%s: not a snapshot\n", file); return false; }
+
+    memset(_len, 0, sizeof(_len));
+    for (ssize_t i = 5; i < n; )
+      {
+        if (i + 2 > n || buf[i + 1] == 0 || buf[i + 1] > Var_cache::Max_data
+            || i + 2 + buf[i + 1] > n)
+          { printf("%s: truncated snapshot\n", file); return false; }
+        set(buf[i], buf + i + 2, buf[i + 1]);
+        i += 2 + buf[i + 1];
+      }
+    return true;
+  }
+
+private:
+  static constexpr char Magic[4] = { 'K', 'W', 'L', 'S' };
+  static constexpr uint8_t Version = 1;
+  uint8_t _len[256] = { 0, };
+  uint8_t _data[256][Var_cache::Max_data];
+};
+
+// Last known state of a unit for --state, so that relative commands and
+// the status line work right after the start. Saved by writing a new file
+// and renaming it over the old one, loaded by mapping it.
+struct Warm_state
+{
+  char     magic[4];
+  uint8_t  version;
+  int8_t   fan_level;             // -1 = unknown
+  int8_t   fan_auto;              // -1 = unknown
+  uint8_t  reserved;
+  int64_t  time;                  // get_wall_ms() the values were seen
+  uint16_t temp[4];
+  uint16_t bypass;                // 0xffff = unknown
+  uint16_t reserved2[3];
+
+  static constexpr char Magic[4] = { 'K', 'W', 'L', 'T' };
+  static constexpr uint8_t Version = 1;
+
+  bool save(char const *file) const
+  {
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+      { perror(tmp); return false; }
+    bool ok = write(fd, this, sizeof(*this)) == (ssize_t)sizeof(*this);
+    close(fd);
+    if (!ok || rename(tmp, file) < 0)
+      {
+        perror(file);
+        unlink(tmp);
+        return false;
+      }
+    return true;
+  }
+
+  // false without a message if there is no state yet
+  bool load(char const *file)
+  {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+        if (errno != ENOENT)
+          perror(file);
+        return false;
+      }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(*this))
+      p = mmap(nullptr, sizeof(*this), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p != MAP_FAILED)
+      {
+        memcpy(this, p, sizeof(*this));
+        munmap(p, sizeof(*this));
+      }
+    if (p == MAP_FAILED || memcmp(magic, Magic, 4) || version != Version)
+      {
+        printf("%s: not a state file\n", file);
+        return false;
+      }
+    return true;
+  }
+};
+
+// Desired state for --apply: "key = value" per line, '#' starts a comment.
+// Keys and values are those of the structured output.
+static bool read_config(char const *file, Snapshot *s)
+{
+  FILE *f = fopen(file, "r");
+  if (!f)
+    { perror(file); return false; }
+
+  char line[256];
+  bool ok = true;
+  for (unsigned nr = 1; fgets(line, sizeof(line), f); ++nr)
+    {
+      char *p = strchr(line, '#');
+      if (p)
+        *p = '\0';
+      for (p = line + strlen(line); p > line && isspace((unsigned char)p[-1]); )
+        *--p = '\0';
+      char *key = line;
+      while (isspace((unsigned char)*key))
+        ++key;
+      if (*key == '\0')
+        continue;
+
+      char *val = strchr(key, '=');
+      if (!val)
+        { printf("%s:%u: expected key = value\n", file, nr); ok = false; continue; }
+      for (p = val++; p > key && isspace((unsigned char)p[-1]); )
+        --p;
+      *p = '\0';
+      while (isspace((unsigned char)*val))
+        ++val;
+
+      Var_desc const *d = find_var_desc(key);
+      uint8_t data[Var_cache::Max_data];
+      unsigned len;
+      if (!d)
+        { printf("%s:%u: unknown variable '%s'\n", file, nr, key); ok = false; }
+      else if (d->flags & (Vf_ro | Vf_volatile))
+        { printf("%s:%u: '%s' cannot be configured\n", file, nr, key); ok = false; }
+      else if (!parse_var(d, val, data, &len))
+        { printf("%s:%u: wrong value for '%s'\n", file, nr, key); ok = false; }
+      else
+        s->set(d->idx, data, len);
+    }
+  fclose(f);
+  return ok;
+}
+
+static char const *const var_type_names[] =
+{ "raw", "u8", "u16", "u32", "tenths", "date", "time", "calendar" };
+
+static char const *const var_flag_names[] =
+{ "ro", "wo", "volatile" };
+
+// Descriptor overlay for --vars as written by --scan, one variable per line:
+//   IDX TYPE COUNT FLAGS KEY [NAME]
+// e.g. "0x1c u16 1 rw var_1c". FLAGS is rw or a comma-separated list of
+// ro, wo and volatile. '#' starts a comment.
+static bool read_var_overlay(char const *file)
+{
+  FILE *f = fopen(file, "r");
+  if (!f)
+    { perror(file); return false; }
+
+  char line[256];
+  bool ok = true;
+  for (unsigned nr = 1; fgets(line, sizeof(line), f); ++nr)
+    {
+      char *p = strchr(line, '#');
+      if (p)
+        *p = '\0';
+      for (p = line + strlen(line); p > line && isspace((unsigned char)p[-1]); )
+        *--p = '\0';
+
+      unsigned idx, count;
+      char type[16], flags[32], key[sizeof(var_overlay_keys[0])];
+      int pos = 0;
+      int n = sscanf(line, "%i %15s %u %31s %23s %n",
+                     &idx, type, &count, flags, key, &pos);
+      if (n <= 0)
+        continue;
+      if (n < 5)
+        { printf("%s:%u: expected IDX TYPE COUNT FLAGS KEY\n", file, nr); ok = false; continue; }
+
+      unsigned t = 0;
+      while (t < 8 && strcmp(type, var_type_names[t]))
+        ++t;
+      unsigned w = t == Vt_u32 ? 4 : t == Vt_u16 || t == Vt_tenths ? 2 : 1;
+      if (t == Vt_date || t == Vt_time || t == Vt_calendar)
+        w = Var_cache::Max_data;
+      if (idx > 0xff)
+        { printf("%s:%u: wrong index\n", file, nr); ok = false; continue; }
+      if (t == 8)
+        { printf("%s:%u: unknown type '%s'\n", file, nr, type); ok = false; continue; }
+      if (count == 0 || count * w > Var_cache::Max_data)
+        { printf("%s:%u: wrong count\n", file, nr); ok = false; continue; }
+
+      unsigned fl = 0;
+      if (strcmp(flags, "rw"))
+        for (char *tok = strtok(flags, ","); tok; tok = strtok(nullptr, ","))
+          {
+            unsigned b = 0;
+            while (b < 3 && strcmp(tok, var_flag_names[b]))
+              ++b;
+            if (b == 3)
+              { printf("%s:%u: unknown flag '%s'\n", file, nr, tok); ok = false; }
+            fl |= 1U << b;
+          }
+      if (!strcmp(key, "unknown") || (key[0] == '0' && key[1] == 'x'))
+        { printf("%s:%u: '%s' cannot be a key\n", file, nr, key); ok = false; continue; }
+
+      snprintf(var_overlay_keys[idx], sizeof(var_overlay_keys[idx]), "%s", key);
+      snprintf(var_overlay_names[idx], sizeof(var_overlay_names[idx]), "%s",
+               line[pos] ? line + pos : key);
+      Var_desc &d = var_overlay[idx];
+      d.idx = idx;
+      d.type = (Var_type)t;
+      d.count = count;
+      d.invalid = 0;
+      d.flags = fl & 7;
+      d.name = var_overlay_names[idx];
+      d.key = var_overlay_keys[idx];
+    }
+  fclose(f);
+  return ok;
+}
+
+// What --scan found out about the variable indices. The reads are repeated
+// in rounds: a variable is dynamic if its value changed from one round to
+// the next, and status broadcast bytes which changed in between are
+// candidates for showing the same value. Bytes which changed while the
+// variable did not are dropped again.
+class Scan_table
+{
+public:
+  enum
+  {
+    Rounds      = 4,
+    Bcast_first = 9,              // status frame offset, clock before
+    Bcast_bytes = 17,
+  };
+
+  void status(uint8_t const *buf, unsigned size, int64_t now)
+  {
+    for (unsigned i = 0; i < Bcast_bytes && Bcast_first + i < size; ++i)
+      {
+        if (_have_bcast && buf[Bcast_first + i] != _bcast[i])
+          _bcast_time[i] = now;
+        _bcast[i] = buf[Bcast_first + i];
+      }
+    _have_bcast = true;
+  }
+
+  void answer(uint8_t idx, uint8_t const *data, unsigned len, int64_t now)
+  {
+    Var &v = _vars[idx];
+    unsigned n = len;
+    if (n > Var_cache::Max_data)
+      n = Var_cache::Max_data;
+    if (v.answers)
+      {
+        uint32_t moved = 0;       // broadcast bytes changed meanwhile
+        for (unsigned i = 0; i < Bcast_bytes; ++i)
+          if (_bcast_time[i] > v.time)
+            moved |= 1U << i;
+        if (len != v.len || memcmp(v.data, data, n))
+          {
+            v.follows = v.changes ? v.follows & moved : moved;
+            ++v.changes;
+          }
+        else
+          v.unfollowed |= moved;
+      }
+    v.len = len;
+    memcpy(v.data, data, n);
+    v.time = now;
+    ++v.answers;
+  }
+
+  bool answered(uint8_t idx) const
+  { return _vars[idx].answers != 0; }
+
+  bool dynamic(uint8_t idx) const
+  { return _vars[idx].changes != 0; }
+
+  // the variables without a descriptor as overlay for --vars
+  bool save(char const *file, char const *dev) const
+  {
+    FILE *f = fopen(file, "w");
+    if (!f)
+      { perror(file); return false; }
+    fprintf(f, "# kwl --scan of %s\n"
+               "# IDX TYPE     COUNT FLAGS  KEY\n", dev);
+    for (unsigned i = 0; i < 256; ++i)
+      {
+        Var const &v = _vars[i];
+        Var_desc const *d = get_builtin_var_desc(i);
+        if (!v.answers || (d && strcmp(d->key, "unknown")))
+          continue;
+
+        unsigned n = v.len;
+        if (n > Var_cache::Max_data)
+          n = Var_cache::Max_data;
+        if (n == 0)
+          {
+            fprintf(f, "# 0x%02x answers without a value\n", i);
+            continue;
+          }
+        Var_type t = n == 1 ? Vt_u8 : n == 2 ? Vt_u16 : n == 4 ? Vt_u32 : Vt_raw;
+        fprintf(f, "0x%02x  %-8s %5u %-8s var_%02x", i, var_type_names[t],
+                t == Vt_raw ? n : 1, v.changes ? "volatile" : "rw", i);
+        fprintf(f, "  # %s", v.changes ? "dynamic" : "static");
+        for (unsigned b = 0; b < n; ++b)
+          fprintf(f, " %02x", v.data[b]);
+        if (v.len > n)
+          fprintf(f, " ... (%u bytes)", v.len);
+        if (v.changes)
+          fprintf(f, ", %u changes", v.changes);
+        uint32_t follows = v.follows & ~v.unfollowed;
+        if (follows)
+          {
+            fprintf(f, ", status byte");
+            for (unsigned b = 0; b < Bcast_bytes; ++b)
+              if (follows & (1U << b))
+                fprintf(f, " %u", Bcast_first + b);
+          }
+        fputc('\n', f);
+      }
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok)
+      { perror(file); return false; }
+    return true;
+  }
+
+private:
+  struct Var
+  {
+    unsigned answers;
+    unsigned changes;
+    uint32_t follows;             // broadcast bytes changed with every change
+    uint32_t unfollowed;          // broadcast bytes changed without a change
+    int64_t  time;                // of the last answer
+    uint8_t  len;                 // as answered, may exceed the data
+    uint8_t  data[Var_cache::Max_data];
+  };
+
+  Var      _vars[256] = {};
+  bool     _have_bcast = false;
+  uint8_t  _bcast[Bcast_bytes];
+  int64_t  _bcast_time[Bcast_bytes] = { 0, };
+};
+
+// Frames of one unit waiting to be rendered by the worker pool. The bus
+// loop is the only producer and at most one worker consumes at a time, so
+// head and tail need no lock.
+class Frame_queue
+{
+public:
+  enum Kind : uint8_t { Valid, Invalid, Unknown };
+
+  struct Frame
+  {
+    int64_t ts;
+    Kind    kind;
+    uint8_t len;
+    uint8_t data[128];
+  };
+
+  // false if full
+  bool push(Kind kind, int64_t ts, uint8_t const *data, unsigned len)
+  {
+    unsigned tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == Size)
+      return false;
+    Frame &f = _ring[tail % Size];
+    f.ts = ts;
+    f.kind = kind;
+    f.len = len < sizeof(f.data) ? len : sizeof(f.data);
+    memcpy(f.data, data, f.len);
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  Frame const *front() const
+  {
+    unsigned head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire))
+      return nullptr;
+    return &_ring[head % Size];
+  }
+
+  void pop()
+  { _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  bool empty() const
+  { return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire); }
+
+  // false if a worker already has the queue or is about to get it
+  bool try_schedule()
+  { return !_scheduled.exchange(true, std::memory_order_acq_rel); }
+
+  void release()
+  { _scheduled.store(false, std::memory_order_release); }
+
+private:
+  static constexpr unsigned Size = 32;
+  Frame _ring[Size];
+  std::atomic<unsigned> _head{0};
+  std::atomic<unsigned> _tail{0};
+  std::atomic<bool> _scheduled{false};
+};
+
+// The week program: 48 half-hour fan levels per day, packed two per byte
+// (low nibble first) behind 3 bytes of unknown use, as on the bus.
+class Week_calendar
+{
+public:
+  enum { Days = 7, Slots = 48, Size = 3 + Slots / 2 };
+
+  void load(unsigned day, uint8_t const *data, unsigned len)
+  {
+    if (day >= Days || len != Size)
+      return;
+    memcpy(_days[day], data, Size);
+    memcpy(_orig[day], data, Size);
+    _valid |= 1U << day;
+  }
+
+  bool valid(unsigned day) const
+  { return _valid & (1U << day); }
+
+  unsigned level(unsigned day, unsigned slot) const
+  {
+    uint8_t b = _days[day][3 + slot / 2];
+    return slot % 2 ? b >> 4 : b & 0xf;
+  }
+
+  // set the slots [from, to) of the days in the mask, if they are known
+  void set(unsigned days, unsigned from, unsigned to, unsigned level)
+  {
+    for (unsigned d = 0; d < Days; ++d)
+      if (days & _valid & (1U << d))
+        for (unsigned s = from; s < to && s < Slots; ++s)
+          {
+            uint8_t &b = _days[d][3 + s / 2];
+            b = s % 2 ? (b & 0x0f) | (level << 4) : (b & 0xf0) | level;
+          }
+  }
+
+  bool changed(unsigned day) const
+  { return valid(day) && memcmp(_days[day], _orig[day], Size); }
+
+  uint8_t const *payload(unsigned day) const
+  { return _days[day]; }
+
+private:
+  uint8_t  _days[Days][Size];
+  uint8_t  _orig[Days][Size];     // as read from the unit
+  unsigned _valid = 0;
+};
+
+// Demand-controlled ventilation for --rules, one rule per line:
+//   co2|humidity THRESHOLD LEVEL [HYSTERESIS]
+// A rule holds while the highest reading of its sensors is at least
+// THRESHOLD and lets go below THRESHOLD - HYSTERESIS. The fan runs at the
+// highest level of the rules holding, in auto mode if none does.
+class Fan_rules
+{
+public:
+  enum Sensor : uint8_t { Co2, Humidity };
+  enum { Max_rules = 16 };
+
+  struct Rule
+  {
+    Sensor  sensor;
+    uint8_t level;
+    int     on;                   // 10th
+    int     off;                  // 10th
+  };
+
+  bool load(char const *file)
+  {
+    FILE *f = fopen(file, "r");
+    if (!f)
+      { perror(file); return false; }
+
+    char line[256];
+    bool ok = true;
+    for (unsigned nr = 1; fgets(line, sizeof(line), f); ++nr)
+      {
+        char *p = strchr(line, '#');
+        if (p)
+          *p = '\0';
+        char sensor[16];
+        double threshold, hyst = 0;
+        unsigned level;
+        int n = sscanf(line, "%15s %lf %u %lf", sensor, &threshold, &level, &hyst);
+        if (n <= 0)
+          continue;
+        if (n < 3)
+          { printf("%s:%u: expected SENSOR THRESHOLD LEVEL [HYSTERESIS]\n", file, nr); ok = false; continue; }
+        if (_num == Max_rules)
+          { printf("%s:%u: too many rules\n", file, nr); ok = false; break; }
+
+        Rule &r = _rules[_num];
+        if (!strcmp(sensor, "co2"))
+          r.sensor = Co2;
+        else if (!strcmp(sensor, "humidity"))
+          r.sensor = Humidity;
+        else
+          { printf("%s:%u: unknown sensor '%s'\n", file, nr, sensor); ok = false; continue; }
+        if (level > 4)
+          { printf("%s:%u: fan level 0..4\n", file, nr); ok = false; continue; }
+        if (threshold < 0 || threshold > 3000 || hyst < 0 || hyst > threshold)
+          { printf("%s:%u: wrong threshold\n", file, nr); ok = false; continue; }
+        r.level = level;
+        r.on = (int)(threshold * 10 + 0.5);
+        r.off = (int)((threshold - hyst) * 10 + 0.5);
+        ++_num;
+      }
+    fclose(f);
+    if (ok && _num == 0)
+      { printf("%s: no rules\n", file); ok = false; }
+    return ok;
+  }
+
+  unsigned num() const
+  { return _num; }
+
+  Rule const &rule(unsigned i) const
+  { return _rules[i]; }
+
+  // update the rules of the sensor in the mask of rules holding, return the
+  // fan level demanded or -1 for auto mode
+  int eval(Sensor sensor, int value, uint32_t *holding) const
+  {
+    int level = -1;
+    for (unsigned i = 0; i < _num; ++i)
+      {
+        Rule const &r = _rules[i];
+        if (r.sensor != sensor)
+          ;
+        else if (value >= r.on)
+          *holding |= 1U << i;
+        else if (value < r.off)
+          *holding &= ~(1U << i);
+        if ((*holding & (1U << i)) && (int)r.level > level)
+          level = r.level;
+      }
+    return level;
+  }
+
+private:
+  Rule     _rules[Max_rules];
+  unsigned _num = 0;
+};
+
+static constexpr unsigned Max_units = 64;
+
+// What to do on a unit; one copy per serial port
+struct Kwl_opts
+{
+  // --set-calendar: slots [from, to) of the days in the mask
+  struct Cal_edit
+  {
+    uint8_t days;
+    uint8_t from;
+    uint8_t to;
+    uint8_t level;
+  };
+  static constexpr unsigned Max_cal_edits = 16;
+  static constexpr unsigned Max_commands = 8;
+
+  bool     opt_do_loop = false;
+  Command  opt_commands[Max_commands]; // settings, queued at the start
+  unsigned opt_num_commands = 0;
+  unsigned opt_get_bypass = 0;
+  uint8_t  opt_cal_days = 0;       // mask of days to show
+  Cal_edit opt_cal_edits[Max_cal_edits];
+  unsigned opt_num_cal_edits = 0;
+  bool     opt_get_hours_on = false;
+  bool     opt_get_party_enabled = false;
+  bool     opt_get_party_time = false;
+  bool     opt_get_party_level = false;
+  bool     opt_get_quiet_enabled = false;
+  bool     opt_get_quiet_time = false;
+  bool     opt_get_quiet_level = false;
+  unsigned opt_get_voltage = 0;
+  unsigned opt_get_preheating = 0;
+  bool     opt_get_run_on_time = false;
+  bool     opt_get_filter_time = false;
+  bool     opt_verbose = false;
+  bool     opt_export = false;
+  Fan_rules const *opt_rules = nullptr;
+  bool     opt_extra_slots = false;
+  bool     opt_passive = false;
+  bool     opt_reads = false;      // a --get option was given
+  bool     initial_temp = true;
+
+  // a value is to be written, nothing for --passive
+  bool has_settings() const
+  { return opt_num_commands || opt_num_cal_edits; }
+
+  // a later setting of the same kind replaces an earlier one
+  void add_command(Command::Type type, int32_t value)
+  {
+    unsigned i = 0;
+    while (i < opt_num_commands && opt_commands[i].type != type)
+      ++i;
+    if (i == Max_commands)
+      return;
+    opt_commands[i].type = type;
+    opt_commands[i].value = value;
+    if (i == opt_num_commands)
+      ++opt_num_commands;
+  }
+};
+
+class Kwl : public Kwl_opts
+{
+public:
+  // dev is either a name below /dev or an absolute path
+  Kwl(Kwl_opts const &opts, char const *dev, unsigned unit, bool multi)
+  : Kwl_opts(opts), _unit(unit), _multi(multi)
+  {
+    snprintf(_path, sizeof(_path), "%s%s", dev[0] == '/' ? "" : "/dev/", dev);
+    char const *base = strrchr(_path, '/');
+    snprintf(_name, sizeof(_name), "%s", base + 1);
+
+    static constexpr int64_t s = 1000000000LL;
+    _reads.add(Var_3a_sensors_temp, 5*s, 60*s);
+    if (opt_rules || opt_export)
+      {
+        _reads.add(Var_3b_sensors_co2, 10*s, 60*s);
+        _reads.add(Var_3c_sensors_humidity, 10*s, 60*s);
+      }
+    if (opt_export)
+      {
+        // keep the values exported by the metrics server reasonably fresh
+        static uint8_t const vars[] =
+        {
+          Var_16_fan_1_voltage, Var_17_fan_2_voltage,
+          Var_18_fan_3_voltage, Var_19_fan_4_voltage,
+          Var_15_hours_on, Var_38_change_filter,
+        };
+        for (uint8_t idx: vars)
+          _reads.add(idx, 60*s, 600*s);
+      }
+
+    for (unsigned i = 0; i < opt_num_commands; ++i)
+      _commands.push(opt_commands[i]);
+  }
+
+  ~Kwl()
+  {
+    delete _snap;
+    delete _scan;
+    if (_latency_file[0] && _latency_orig)
+      write_latency(_latency_orig); // as it was for other programs
+    if (_serial_changed)
+      {
+        struct serial_struct ss;
+        if (ioctl(_sp, TIOCGSERIAL, &ss) == 0)
+          {
+            ss.flags = _serial_flags_orig;
+            ioctl(_sp, TIOCSSERIAL, &ss);
+          }
+      }
+    unlock();
+    if (_sp >= 0)
+      close(_sp);
+  }
+
+  bool uart_open()
+  {
+    _sp = open(_path, O_RDWR | O_CLOEXEC);
+    if (_sp < 0)
+      {
+        perror(_path);
+        return false;
+      }
+    return true;
+  }
+
+  // UUCP-style lock file so that no other program uses the port
+  bool lock()
+  {
+    char lock[sizeof("/var/lock/") + NAME_MAX];
+    snprintf(lock, sizeof(lock), "/var/lock/%s", _name);
+    int fd = open(lock, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, S_IWUSR);
+    if (fd < 0)
+      {
+        printf("Cannot lock %s\n", lock);
+        return false;
+      }
+    close(fd);
+    _locked = true;
+    return true;
+  }
+
+  void unlock()
+  {
+    if (!_locked)
+      return;
+    char lock[sizeof("/var/lock/") + NAME_MAX];
+    snprintf(lock, sizeof(lock), "/var/lock/%s", _name);
+    unlink(lock);
+    _locked = false;
+  }
+
+  char const *name() const
+  { return _name; }
+
+  unsigned unit() const
+  { return _unit; }
+
+  // name for output which has to tell units apart, nullptr for a single unit
+  char const *label() const
+  { return _multi ? _name : nullptr; }
+
+  // read all known variables and save their payloads to file
+  void start_dump(char const *file)
+  {
+    snprintf(_job_file, sizeof(_job_file), "%s", file);
+    _snap = new Snapshot;
+    _job = Job_dump;
+    for (unsigned i = 0; i < 256; ++i)
+      {
+        Var_desc const *d = get_var_desc(i);
+        if (d && !(d->flags & Vf_wo))
+          _pending.set(i);
+      }
+    start_phase(false);
+  }
+
+  // write the variables of a snapshot which differ from the unit
+  bool start_restore(char const *file)
+  {
+    _snap = new Snapshot;
+    if (!_snap->load(file))
+      return false;
+    start_sync();
+    return true;
+  }
+
+  // bring the unit into the state given by a config file, see read_config()
+  void start_apply(Snapshot const &target)
+  {
+    _snap = new Snapshot(target);
+    _apply = true;
+    start_sync();
+  }
+
+  // read the days to be shown or edited in one burst, then write the days
+  // which were changed
+  void start_calendar()
+  {
+    unsigned days = opt_cal_days;
+    for (unsigned i = 0; i < opt_num_cal_edits; ++i)
+      days |= opt_cal_edits[i].days;
+    _job = Job_calendar;
+    if (opt_num_cal_edits && !_snap)
+      _snap = new Snapshot; // the days to write, not allocated in the loop
+    for (unsigned d = 0; d < Week_calendar::Days; ++d)
+      if (days & (1U << d))
+        _pending.set(Var_00_calendar_mon + d);
+    start_phase(false);
+  }
+
+  // read every index in several rounds and save what was found out about
+  // the variables without a descriptor as overlay file, see Scan_table
+  void start_scan(char const *file)
+  {
+    snprintf(_job_file, sizeof(_job_file), "%s", file);
+    _scan = new Scan_table;
+    _job = Job_scan;
+    _pending.set();
+    start_phase(false);
+  }
+
+  // any thread: queue a command for the bus loop and wake it up
+  bool command(Command const &c)
+  {
+    if (!_commands.push(c))
+      return false;
+    if (_command_fd >= 0)
+      {
+        uint64_t one = 1;
+        ssize_t ret = ::write(_command_fd, &one, sizeof(one));
+        (void)ret; // fails only when signalled often enough already
+      }
+    return true;
+  }
+
+  bool command(Command::Type type, int32_t value)
+  {
+    Command c{};
+    c.type = type;
+    c.value = value;
+    return command(c);
+  }
+
+  // any thread: queue a write, its outcome is told by writes().result()
+  bool queue_write(uint8_t idx, uint8_t const *data, unsigned len,
+                   Write_box::Ticket *t)
+  {
+    Command c{};
+    c.type = Command::Write;
+    c.idx = idx;
+    c.len = len < Var_cache::Max_data ? len : (unsigned)Var_cache::Max_data;
+    memcpy(c.data, data, c.len);
+    *t = _writes.ticket(idx);
+    c.gen = t->gen;
+    return command(c);
+  }
+
+  // any thread: queue a read, the value arrives in cache()
+  bool queue_read(uint8_t idx)
+  {
+    Command c{};
+    c.type = Command::Read;
+    c.idx = idx;
+    return command(c);
+  }
+
+  // bus loop: take over the queued commands
+  void take_commands()
+  {
+    Command c;
+    bool any = false;
+    while (_commands.pop(&c))
+      {
+        any = true;
+        switch (c.type)
+          {
+          case Command::Set_time:    _set_time = c.value; break;
+          case Command::Set_bypass:  _set_bypass = c.value; break;
+          case Command::Set_fan:     _set_fan = c.value; break;
+          case Command::Fan_step:    fan_step(c.value); break;
+          case Command::Set_party:   _set_party = c.value; break;
+          case Command::Set_quiet:   _set_quiet = c.value; break;
+          case Command::Set_voltage: _set_voltage = c.value; break;
+          case Command::Write:
+            _writes.put(c.idx, c.data, c.len, c.gen);
+            break;
+          case Command::Read:
+            _requests.read(c.idx);
+            break;
+          }
+      }
+    // nothing to say in our next slot was prepared: prepare it again
+    if (any && _tx_prepared && !_tx_size)
+      _tx_prepared = false;
+  }
+
+  // bus loop: fan up/down; a step pressed before the previous one went out
+  // continues from the level that one sets
+  void fan_step(int change)
+  {
+    int level = -1;
+    if (_set_fan < 0x200 && (_set_fan & 0xff) >= 1
+        && (_set_fan & 0xff) <= 4)
+      level = _set_fan & 0xff;
+    else if ((_set_fan == 0xf000 || _set_fan == 0xe000) && _fan_level > 0)
+      level = _fan_level + (_set_fan == 0xf000 ? 1 : -1);
+
+    if (level < 0)
+      _set_fan = change > 0 ? 0xf000 : 0xe000;
+    else if (level + change >= 1 && level + change <= 4)
+      _set_fan = (_fan_auto ? 0x100 : 0) | (level + change);
+  }
+
+  // start with the state saved in file by an earlier run, the bus confirms
+  // the values later; save the state there from time to time and at exit
+  void use_state(char const *file)
+  {
+    snprintf(_state_file, sizeof(_state_file), "%s", file);
+    _state_saved = get_time();
+    Warm_state s;
+    if (!s.load(file))
+      return;
+    memcpy(_temp, s.temp, sizeof(_temp));
+    _bypass = s.bypass;
+    _fan_level = s.fan_level;
+    _fan_auto = s.fan_auto;
+    _state_time = s.time;
+
+    if (_enc.format() == Encoder::Text)
+      {
+        int64_t age = (get_wall_ms() - s.time) / 1000;
+        print_prefix();
+        printf("\033[32mstate\033[m of %lld%s ago:",
+               (long long)(age < 120 ? age : age / 60), age < 120 ? "s" : "min");
+        if (_fan_level >= 0)
+          printf(" fan %s/%d", _fan_auto ? "auto" : "manual", _fan_level);
+        if (_bypass != 0xffff)
+          printf(" bypass %d.%d°C", _bypass / 10, _bypass % 10);
+        putchar('\n');
+      }
+  }
+
+  void save_state()
+  {
+    _state_saved = get_time();
+    Warm_state s;
+    if (get_state(&s))
+      s.save(_state_file);
+  }
+
+  // bus thread: hand the state over to the State_saver, the disk may be
+  // slow and the bus thread real-time
+  void stage_state(int64_t now)
+  {
+    std::unique_lock<std::mutex> l(_state_lock, std::try_to_lock);
+    if (!l.owns_lock())
+      return; // being taken, try again in the next turn
+    _state_saved = now;
+    _state_staged_ready = get_state(&_state_staged);
+  }
+
+  // State_saver thread: write what the bus thread staged
+  void write_staged_state()
+  {
+    Warm_state s;
+    {
+      std::lock_guard<std::mutex> g(_state_lock);
+      if (!_state_staged_ready)
+        return;
+      s = _state_staged;
+      _state_staged_ready = false;
+    }
+    s.save(_state_file);
+  }
+
+  // false if there is nothing to save
+  bool get_state(Warm_state *s) const
+  {
+    if (!_state_file[0] || _state_time == 0)
+      return false;
+    *s = {};
+    memcpy(s->magic, Warm_state::Magic, 4);
+    s->version = Warm_state::Version;
+    s->fan_level = _fan_level;
+    s->fan_auto = _fan_auto;
+    s->time = _state_time;
+    memcpy(s->temp, _temp, sizeof(s->temp));
+    s->bypass = _bypass;
+    return true;
+  }
+
+  // a dump, restore, apply, calendar edit or scan did not complete
+  bool failed() const
+  { return _failed; }
+
+  // nothing left to do on this unit (not looping or the port failed)
+  bool done() const
+  { return _done; }
+
+  void finish()
+  { _done = true; }
+
+  // leave rendering of structured output to the worker pool
+  void defer_output()
+  { _deferred = true; }
+
+  Frame_queue &output()
+  { return _out; }
+
+  // render the queued frames, called by the worker holding the queue
+  void drain(Encoder &e)
+  {
+    Paket p;
+    while (Frame_queue::Frame const *f = _out.front())
+      {
+        p.new_paket(f->data, f->len);
+        render(e, f->kind, p, f->ts);
+        _out.pop();
+        e.flush_full();
+      }
+  }
+
+  bool uart_setup()
+  {
+    struct termios tty;
+    memset(&tty, 0, sizeof(tty));
+
+    if (tcgetattr(_sp, &tty) != 0)
+      { perror("tcgetattr"); return false; }
+
+    tty.c_cflag &= ~(PARENB|CSTOPB|CSIZE|CRTSCTS);
+    tty.c_cflag |= CS8|CREAD|CLOCAL;
+
+    tty.c_lflag &= ~(ICANON|ECHO|ECHOE|ECHONL|ISIG);
+    tty.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
+    tty.c_iflag &= ~(IXON|IXOFF|IXANY);
+
+    tty.c_oflag &= ~(OPOST|ONLCR);
+
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+
+    cfsetispeed(&tty, B19200); // specific to KWL EC-270/370 Pro
+    cfsetospeed(&tty, B19200); // specific to KWL EC-270/370 Pro
+
+    if (tcsetattr(_sp, TCSANOW, &tty) != 0)
+      { perror("tcsetattr"); return false; }
+
+    return true;
+  }
+
+  int uart_fd() const
+  { return _sp; }
+
+  ssize_t uart_read(uint8_t *buf, unsigned size)
+  {
+    ssize_t n = read(_sp, buf, size);
+    if (n > 0 && _tune != Tune_off)
+      tune_measure(n);
+    return n;
+  }
+
+  // --low-latency: measure how long received bytes wait in the driver,
+  // switch to low-latency settings and measure again
+  void start_low_latency()
+  {
+    _tune = Tune_before;
+    _tune_start = get_time() + Tune_settle; // what piled up before the start
+  }
+
+  // report what was measured so far, at the end of a short run
+  void tune_report()
+  {
+    if (_tune == Tune_before || _tune == Tune_after)
+      tune_done();
+  }
+
+  // A read returning n bytes got the first of them at least n - 1 byte
+  // times late: bytes at 19200 baud arrive every 521us, a driver passing
+  // them on at once returns one or two per read.
+  void tune_measure(unsigned n)
+  {
+    if (get_time() < _tune_start)
+      return;
+    ++_tune_reads;
+    _tune_bytes += n;
+    _tune_delay += (n - 1) * Byte_time;
+    if (get_time() - _tune_start < Tune_window)
+      return;
+    if (_tune == Tune_before)
+      {
+        _tune_result[0] = { _tune_reads, _tune_bytes, _tune_delay };
+        _tune_reads = _tune_bytes = 0;
+        _tune_delay = 0;
+        set_low_latency();
+        _tune = Tune_after;
+        _tune_start = get_time();
+      }
+    else
+      tune_done();
+  }
+
+  void tune_done()
+  {
+    unsigned phase = _tune == Tune_before ? 0 : 1;
+    _tune_result[phase] = { _tune_reads, _tune_bytes, _tune_delay };
+    _tune = Tune_off;
+
+    FILE *out = _enc.format() == Encoder::Text ? stdout : stderr;
+    fprintf(out, "%s%s\033[32mlow latency\033[m %s;", _multi ? _name : "",
+            _multi ? ": " : "", phase ? _tune_msg : "not applied yet");
+    for (unsigned i = 0; i <= phase; ++i)
+      {
+        Tune_result const &r = _tune_result[i];
+        if (r.reads)
+          fprintf(out, "%s %s %.1f bytes/read, rx delay %.2fms",
+                  i ? "," : "", i ? "after" : "before", (double)r.bytes / r.reads,
+                  r.delay / 1e6 / r.reads);
+      }
+    fputc('\n', out);
+  }
+
+  // ASYNC_LOW_LATENCY and the USB latency timer of FTDI style adapters,
+  // whatever the driver supports and we are allowed to change
+  void set_low_latency()
+  {
+    unsigned n = 0;
+    struct serial_struct ss;
+    if (ioctl(_sp, TIOCGSERIAL, &ss) == 0)
+      {
+        _serial_flags_orig = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        bool ok = ioctl(_sp, TIOCSSERIAL, &ss) == 0;
+        _serial_changed = ok && !(_serial_flags_orig & ASYNC_LOW_LATENCY);
+        n += snprintf(_tune_msg, sizeof(_tune_msg), "low_latency flag %s",
+                      ok ? "set" : strerror(errno));
+      }
+
+    char real[PATH_MAX];
+    if (!realpath(_path, real))
+      return;
+    snprintf(_latency_file, sizeof(_latency_file),
+             "/sys/bus/usb-serial/devices/%s/latency_timer",
+             strrchr(real, '/') + 1);
+    FILE *f = fopen(_latency_file, "r");
+    if (!f)
+      {
+        _latency_file[0] = '\0';
+        return; // not a USB serial adapter with a latency timer
+      }
+    if (fscanf(f, "%u", &_latency_orig) != 1)
+      _latency_orig = 0;
+    fclose(f);
+    char const *err = write_latency(1);
+    snprintf(_tune_msg + n, sizeof(_tune_msg) - n, "%slatency timer %ums%s%s",
+             n ? ", " : "", _latency_orig, err ? ": " : " -> 1ms",
+             err ? err : "");
+    if (err)
+      _latency_file[0] = '\0'; // nothing to restore
+  }
+
+  // nullptr on success
+  char const *write_latency(unsigned ms)
+  {
+    int fd = open(_latency_file, O_WRONLY | O_CLOEXEC);
+    char buf[8];
+    int len = snprintf(buf, sizeof(buf), "%u", ms);
+    if (fd < 0 || write(fd, buf, len) != len)
+      {
+        char const *err = strerror(errno);
+        if (fd >= 0)
+          close(fd);
+        return err;
+      }
+    close(fd);
+    return nullptr;
+  }
+
+  // encode the frame to be transmitted in our next slot
+  void send_frame(uint8_t *buf, uint8_t size)
+  {
+    if (size < 4 || size > sizeof(_tx))
+      { printf("\033[31msnd_frame: Invalid size!\n"); return; }
+
+    buf[2] = size - 4;
+    uint8_t chksum = 0;
+    for (uint8_t i = 0; i < size - 1; ++i)
+      chksum += buf[i];
+    chksum += 1;
+    buf[size - 1] = chksum;
+    memcpy(_tx, buf, size);
+    _tx_size = size;
+  }
+
+  // transmit the staged frame as answer to the poll received at poll_time
+  void transmit(int64_t poll_time)
+  {
+    uint8_t size = _tx_size;
+    _tx_size = 0;
+    _tx_prepared = false;
+    if (!size)
+      return;
+
+    // give the master time to switch its transceiver to receive
+    int64_t t = poll_time + Reply_delay;
+    struct timespec ts = { (time_t)(t / 1000000000), (long)(t % 1000000000) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+      ;
+    int written = write(_sp, _tx, size);
+    int64_t latency = get_time() - poll_time;
+    _stats.reply(latency, Reply_window);
+    if (latency > Reply_window && _enc.format() == Encoder::Text)
+      {
+        print_prefix();
+        printf("\033[31mreply deadline missed by %lldms\033[m\n",
+               (long long)(latency - Reply_window) / 1000000);
+      }
+    if (written != (ssize_t)size)
+      {
+        printf("\033[31msnd_frame: Sent %d != %d bytes!\n", written, size);
+        return;
+      }
+    // what follows the poll is known once the batch with the poll is
+    // processed, the frames before it must not reset it
+    if ((_tx[0] & 0xfc) == 0x10 && (_tx[1] == 1 ? size >= 6 : size == 5))
+      {
+        Sent &s = _sent[_tx[0] & 3];
+        s.valid = true;
+        s.write = _tx[1] == 1;
+        s.idx = _tx[3];
+        s.len = s.write ? size - 5 : 0;
+        if (s.len > Var_cache::Max_data)
+          s.len = Var_cache::Max_data;
+        memcpy(s.data, _tx + 4, s.len);
+      }
+    if (_tx[3] != Var_3a_sensors_temp && false)
+      _p.print("\033[1msuccessful sent: ", true);
+  }
+
+  // process a received byte
+  void rx_byte(uint8_t c, int64_t now)
+  {
+    _stats.inc(Bus_stats::Rx_bytes);
+    if (_rx_idx && now - _rx_last >= Frame_gap)
+      rx_flush(now);
+    _rx_last = now;
+
+    if (_rx_idx >= sizeof(_rx_buf))
+      {
+        _stats.inc(Bus_stats::Overflows);
+        if (_enc.format() == Encoder::Text)
+          {
+            print_prefix();
+            printf("\033[31mBuffer overflow\033[m\n");
+          }
+        _rx_idx = 0;
+        return;
+      }
+
+    _rx_buf[_rx_idx++] = c;
+
+    if (_rx_idx == 4 && !memcmp(_rx_buf, Poll_us, 4))
+      our_turn(now);
+    else if (   _rx_idx == 4 && opt_extra_slots && _extra.free(_rx_buf[0])
+             && _rx_buf[1] == 0 && _rx_buf[2] == 0
+             && _rx_buf[3] == (uint8_t)(_rx_buf[0] + 1))
+      extra_turn(_rx_buf[0], now);
+  }
+
+  // nanoseconds until the current frame is complete, -1 if nothing pending
+  int64_t rx_timeout(int64_t now) const
+  {
+    if (!_rx_idx)
+      return -1;
+    int64_t t = _rx_last + Frame_gap - now;
+    return t > 0 ? t : 0;
+  }
+
+  // the bus was idle long enough: process the received frame(s)
+  void rx_flush(int64_t now)
+  {
+    got_frame(now - _rx_last, _rx_buf, _rx_idx);
+    _rx_idx = 0;
+    _enc.flush_batch(now);
+
+    // prepare our answer while waiting for the poll
+    if (!opt_passive && !_tx_prepared && _schedule.imminent(now))
+      {
+        prepare_turn();
+        _tx_prepared = true;
+      }
+  }
+
+  void send_get_var(uint8_t idx)
+  {
+    uint8_t snd[5] = { 0x13, 0, 1, idx };
+    send_frame(snd, sizeof(snd));
+  }
+
+  // the value was seen on the bus since time
+  bool cached_since(unsigned idx, int64_t time) const
+  {
+    Var_cache::Entry e;
+    return _cache.load(idx, &e) && e.time >= time;
+  }
+
+  void send_set_var_8bit(uint8_t idx, uint8_t val)
+  {
+    uint8_t snd[6] = { 0x13, 1, 2, idx, val };
+    send_frame(snd, sizeof(snd));
+  }
+
+  void send_set_var_16bit(uint8_t idx, uint16_t val)
+  {
+    uint8_t snd[7] = { 0x13, 1, 3, idx,
+                       (uint8_t)(val % 256), (uint8_t)(val / 256) };
+    send_frame(snd, sizeof(snd));
+  }
+
+  void send_set_var(uint8_t idx, uint8_t const *data, unsigned len)
+  {
+    uint8_t snd[sizeof(_tx)] = { 0x13, 1, 0, idx };
+    if (len + 5 > sizeof(snd))
+      { printf("\033[31msend_set_var: Invalid size!\n"); return; }
+    memcpy(snd + 4, data, len);
+    send_frame(snd, len + 5);
+  }
+
+  // send the next queued request, answers are not waited for
+  void send_request()
+  {
+    // a read answered in this phase already, e.g. to a wall panel, is dropped
+    while (   !_requests.empty() && !_requests.front().write
+           && _job != Job_none && _job != Job_scan
+           && cached_since(_requests.front().idx, _phase_start))
+      {
+        _requests.pop();
+        _stats.inc(Bus_stats::Reads_saved);
+      }
+    if (_requests.empty())
+      return;
+
+    Request_queue::Request const &r = _requests.front();
+    if (r.write)
+      {
+        _acked.reset(r.idx);
+        send_set_var(r.idx, r.data, r.len);
+      }
+    else
+      {
+        send_get_var(r.idx);
+        _silent.set(r.idx);
+      }
+    _requests.pop();
+  }
+
+  void send_set_var_32bit(uint8_t idx, uint32_t val)
+  {
+    uint8_t snd[9] = { 0x13, 1, 5, idx,
+                       (uint8_t)(val & 0xff),
+                       (uint8_t)((val >> 8) & 0xff),
+                       (uint8_t)((val >> 16) & 0xff),
+                       (uint8_t)((val >> 24) & 0xff) };
+    send_frame(snd, sizeof(snd));
+  }
+
+  void print_calendar_level(unsigned level) const
+  {
+    switch (level)
+      {
+      case 1: printf("__"); break;
+      case 2: printf("——"); break;
+      case 3: printf("‾‾"); break;
+      default: printf("% d", level); break;
+      }
+  }
+
+  unsigned volume_flow(uint8_t v)
+  {
+    if (v <   1) return 0;
+    if (v <  24) return 60;
+    if (v <  30) return 80;
+    if (v <  37) return 100;
+    if (v <  43) return 120;
+    if (v <  50) return 140;
+    if (v <  56) return 160;
+    if (v <  63) return 180;
+    if (v <  69) return 200;
+    if (v <  76) return 220;
+    if (v <  82) return 240;
+    if (v <  89) return 260;
+    if (v <  95) return 280;
+    if (v < 100) return 300;
+    return 315;
+  }
+
+  // pakets only shown with --verbose
+  bool is_chatter() const
+  {
+    return    _p.is_ping(0x10)
+           || _p.is_ping(0x11)
+           || _p.is_ping(0x12)
+           || _p.is_ping(0x13)
+           || _p.is_request(Var_35_fan_level)
+           || _p.is_request(Var_3a_sensors_temp)
+           || _p.is_request(Var_3b_sensors_co2)
+           || _p.is_request(Var_3c_sensors_humidity)
+           || _p.is_ack_10()
+           || _p.is_fan_no_change();
+  }
+
+  // pakets which only feed the status line or a dump/restore
+  bool is_silent()
+  {
+    return    _p.is_status(Var_3a_sensors_temp, 21)
+           || (opt_rules && (   _p.is_status(Var_3b_sensors_co2, 9)
+                             || _p.is_status(Var_3c_sensors_humidity, 9)))
+           || _silent_answer
+           || (_interactive && (   _p.is_status(Var_10_party_curr_time, 3)
+                                || _p.is_status(Var_1e_bypass1_temp, 3)
+                                || _p.is_status(Var_54_quiet_curr_time, 3)));
+  }
+
+  // with several units, tell which one a line belongs to
+  void print_prefix() const
+  {
+    if (_multi)
+      printf("%s: ", _name);
+  }
+
+  // the poll of addr: expect the answer to the frame we sent in its slot,
+  // we might not see our own request; return what we sent
+  Extra_slots::Op take_sent(uint8_t addr)
+  {
+    _answered = -1;
+    if ((addr & 0xfc) != 0x10 || !_sent[addr & 3].valid)
+      return Extra_slots::None;
+    Sent &s = _sent[addr & 3];
+    s.valid = false;
+    _answered = addr;
+    if (s.write)
+      {
+        _sent_idx = s.idx;
+        _sent_len = s.len;
+        memcpy(_sent_data, s.data, s.len);
+      }
+    else
+      {
+        _request_idx = s.idx;
+        _request_from = Poll_us[0];
+      }
+    return s.write ? Extra_slots::Write : Extra_slots::Read;
+  }
+
+  // remember status broadcasts and answers of the master to read requests,
+  // also those to other panels, and the settings other panels wrote
+  void cache_paket(int64_t now)
+  {
+    uint8_t const *buf = _p.raw();
+    _silent_answer = false;
+    if (_p.is_start_status())
+      {
+        if (_p.size() == 27)
+          {
+            _cache.store(Var_cache::Status, buf + 3, _p.size() - 4, now);
+            for (Bcast_var const &v: bcast_vars)
+              {
+                uint8_t data[sizeof(v.offs)];
+                for (unsigned i = 0; i < v.len; ++i)
+                  data[i] = buf[v.offs[i]];
+                _cache.store(v.idx, data, v.len, now);
+              }
+          }
+        if (_scan && _p.size() == 27)
+          _scan->status(buf, _p.size(), now);
+      }
+    else if (buf[1] == 0 && _p.dsize() == 1)
+      {
+        _request_idx = buf[3];
+        _request_from = buf[0] == _answered ? Poll_us[0] : buf[0];
+        return;
+      }
+    else if (buf[1] == 0 && _p.dsize() == 0)
+      return; // the answer to our request follows the poll
+    else if (buf[1] == 5 && _p.dsize() == 2 && buf[4] == 0x55)
+      {
+        _acked.set(buf[3]);
+        if (buf[3] == _write_idx)
+          {
+            write_acked(buf[3], _write_data, _write_len, now);
+            _stats.inc(Bus_stats::Harvested);
+          }
+        else if (buf[3] == _sent_idx)
+          {
+            write_acked(buf[3], _sent_data, _sent_len, now);
+            _writes.acked(buf[3], _sent_data, _sent_len);
+          }
+        _sent_idx = -1;
+      }
+    else if (buf[1] == 1 && _p.dsize() >= 1 && buf[3] == _request_idx)
+      {
+        _cache.store(buf[3], buf + 4, _p.dsize() - 1, now);
+        if (_request_from != Poll_us[0])
+          _stats.inc(Bus_stats::Harvested);
+        else if (_silent.test(buf[3]))
+          {
+            _silent.reset(buf[3]);
+            _silent_answer = true;
+          }
+        if (_scan)
+          _scan->answer(buf[3], buf + 4, _p.dsize() - 1, now);
+      }
+    else if (   buf[1] == 1 && _p.dsize() >= 2 && buf[0] != Poll_us[0]
+             && buf[0] != _answered
+             && (is_setting(buf[3]) || buf[3] == Var_35_fan_level))
+      {
+        // a panel writes, the value holds once acknowledged
+        _write_idx = buf[3];
+        _write_len = _p.dsize() - 1;
+        if (_write_len > Var_cache::Max_data)
+          _write_len = Var_cache::Max_data;
+        memcpy(_write_data, buf + 4, _write_len);
+        _request_idx = -1;
+        return;
+      }
+    _request_idx = -1;
+    _write_idx = -1;
+  }
+
+  // a write was acknowledged: take the value as if read back, the next
+  // broadcast or read corrects it should the unit think otherwise
+  void write_acked(uint8_t idx, uint8_t const *data, unsigned len, int64_t now)
+  {
+    if (idx == Var_35_fan_level && len == 2)
+      {
+        if (data[0] == 0xaa && data[1] <= 1)
+          _fan_auto = data[1];
+        else if (data[1] == 0xbb)
+          {
+            _fan_level = data[0];
+            _fan_auto = 0;
+          }
+        if (_fan_level >= 0 && _fan_auto >= 0)
+          {
+            uint8_t fan[2] = { (uint8_t)_fan_level, (uint8_t)_fan_auto };
+            _cache.store(Var_35_fan_level, fan, 2, now);
+          }
+        _state_time = get_wall_ms();
+        return;
+      }
+    if (idx == Var_1e_bypass1_temp && len == 2)
+      {
+        _bypass = data[0] | (data[1] << 8);
+        _state_time = get_wall_ms();
+      }
+    if (is_setting(idx))
+      _cache.store(idx, data, len, now);
+  }
+
+  // a written value is read back as it was written (not a command)
+  static bool is_setting(unsigned idx)
+  {
+    Var_desc const *d = get_var_desc(idx);
+    return d && !(d->flags & (Vf_ro | Vf_wo | Vf_volatile));
+  }
+
+  // remember values needed for the status line and for relative changes
+  void update_state()
+  {
+    uint8_t const *buf = _p.raw();
+
+    if (_p.is_status(Var_10_party_curr_time, 3))
+      {
+        _party = _p.u16(0);
+        _party_read = get_time();
+        _party_sync = false;
+      }
+
+    else if (_p.is_status(Var_1e_bypass1_temp, 3))
+      {
+        _bypass = _p.u16(0);
+        _state_time = get_wall_ms();
+      }
+
+    else if (_p.is_status(Var_3a_sensors_temp, 21))
+      {
+        for (unsigned i = 0; i < 4; ++i)
+          _temp[i] = _p.u16(1 + i);
+        _state_time = get_wall_ms();
+      }
+
+    else if (_p.is_status(Var_54_quiet_curr_time, 3))
+      {
+        _quiet = _p.u16(0);
+        _quiet_read = get_time();
+        _quiet_sync = false;
+      }
+
+    else if (_p.is_status(Var_3b_sensors_co2, 9))
+      apply_rules(Fan_rules::Co2, 9999);
+
+    else if (_p.is_status(Var_3c_sensors_humidity, 9))
+      apply_rules(Fan_rules::Humidity, 999);
+
+    else if (buf[1] == 5 && _p.dsize() == 2 && buf[4] == 0x55)
+      {
+        // a party/quiet setting was written, by us or another panel
+        if (   buf[3] == Var_0f_party_enabled || buf[3] == Var_10_party_curr_time
+            || buf[3] == Var_11_party_time)
+          _party_sync = true;
+        else if (   buf[3] == Var_55_quiet_enabled
+                 || buf[3] == Var_54_quiet_curr_time
+                 || buf[3] == Var_56_quiet_time)
+          _quiet_sync = true;
+      }
+
+    else if (buf[0] == 0xff && buf[1] == 0xff)
+      {
+        // party and quiet change the fan level
+        if (   _fan_level != -1
+            && (_fan_level != buf[9] || _fan_auto != (buf[10] > 0)))
+          _party_sync = _quiet_sync = true;
+        _fan_level = buf[9];
+        _fan_auto  = buf[10] > 0;
+        _state_time = get_wall_ms();
+      }
+  }
+
+  // minutes of a party/quiet timer left, counted down from the last read
+  static uint16_t timer_left(uint16_t minutes, int64_t read, int64_t now)
+  {
+    int64_t gone = (now - read) / 60000000000LL;
+    return gone < minutes ? minutes - gone : 0;
+  }
+
+  // a timer is read again after a change, when it should have run out and
+  // from time to time against drift
+  static bool timer_due(uint16_t minutes, int64_t read, bool sync, int64_t now)
+  {
+    return    sync
+           || (minutes && (   now - read > Timer_resync
+                           || timer_left(minutes, read, now) == 0));
+  }
+
+  // evaluate the --rules on a sensor reading and queue the change of the
+  // fan level for our next slot
+  void apply_rules(Fan_rules::Sensor sensor, uint16_t invalid)
+  {
+    if (!opt_rules)
+      return;
+    int value = -1;
+    for (unsigned i = 0; i < 4; ++i)
+      if (_p.u16(i) != invalid && (int)_p.u16(i) > value)
+        value = _p.u16(i);
+    if (value < 0)
+      return;
+
+    int level = opt_rules->eval(sensor, value, &_rules_holding);
+    if (level == _rules_level)
+      return;
+    static uint8_t const manual[2] = { 0xaa, 0x00 };
+    static uint8_t const automatic[2] = { 0xaa, 0x01 };
+    uint8_t const set[2] = { (uint8_t)level, 0xbb };
+    bool ok;
+    if (level < 0)
+      ok = _requests.write(Var_35_fan_level, automatic, 2);
+    else
+      ok =    (_rules_level >= 0 || _requests.write(Var_35_fan_level, manual, 2))
+           && _requests.write(Var_35_fan_level, set, 2);
+    if (!ok)
+      return; // again with the next reading
+
+    if (_enc.format() == Encoder::Text)
+      {
+        print_prefix();
+        printf("\033[32mrules\033[m %s %d.%d: fan ",
+               sensor == Fan_rules::Co2 ? "CO₂" : "humidity",
+               value / 10, value % 10);
+        if (level < 0)
+          printf("auto\n");
+        else
+          printf("level %d\n", level);
+      }
+    _rules_level = level;
+  }
+
+  void print_paket(uint64_t time)
+  {
+    if ((!opt_verbose && is_chatter()) || is_silent())
+      return;
+
+    uint8_t const *buf = _p.raw();
+
+    // only one status line at the bottom of the terminal
+    if (buf[0] == 0xff && buf[1] == 0xff)
+      {
+        if (_unit != 0)
+          return;
+      }
+    else
+      print_prefix();
+
+    if (buf[1] == 5 && _p.dsize() == 2 && buf[4] == 0x55)
+      printf("\033[32mack '%s' (%02x) written\033[m\n",
+             get_var_name(buf[3]), buf[3]);
+
+    else if (false) // print all pakets
+      {
+        printf("%4lldms (%02x) ", time / 1000000, buf[0]);
+        _p.print("\033[1m", true); // uninterpreted
+      }
+
+    else if (buf[1] == 1 && _p.dsize() == 28 && buf[3] <= Var_06_calendar_sun)
+      {
+        for (unsigned i = 0; i < 24; ++i)
+          {
+            print_calendar_level(buf[i + 7] & 0xf);
+            print_calendar_level(buf[i + 7] >> 4);
+          }
+        printf("\n");
+        for (unsigned i = 0; i < 24; ++i)
+          printf("%-4d", i);
+        printf("\n");
+      }
 
-    tty.c_cflag &= ~(PARENB|CSTOPB|CSIZE|CRTSCTS);
-    tty.c_cflag |= CS8|CREAD|CLOCAL;
+    else if (_p.is_status(Var_0e_preheat_temp, 3))
+      printf("\033[32mpre-heating\033[m = %d.%d°C\n",
+             _p.u16(0) / 10, _p.u16(0) % 10);
 
-    tty.c_lflag &= ~(ICANON|ECHO|ECHOE|ECHONL|ISIG);
-    tty.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);
-    tty.c_iflag &= ~(IXON|IXOFF|IXANY);
+    else if (_p.is_status(Var_10_party_curr_time, 3))
+      {
+        if (_party == 0)
+          printf("\033[32mparty disabled\033[m\n");
+        else
+          printf("\033[32mparty enabled for %dmin\n", _party);
+      }
 
-    tty.c_oflag &= ~(OPOST|ONLCR);
+    else if (_p.is_status(Var_11_party_time, 3))
+      printf("\033[32mparty time\033[m = %dmin\n", _p.u16(0));
 
-    tty.c_cc[VMIN] = 1;
-    tty.c_cc[VTIME] = 0;
+    else if (_p.is_status(Var_15_hours_on, 5))
+      {
+        uint32_t h = _p.u32(0);
+        printf("\033[32mhours on\033[m = %dh (%d.%dyrs)\n",
+               h, ((h * 10) / (365 * 24)) / 10, ((h * 10) / (365 * 24)) % 10);
+      }
 
-    cfsetispeed(&tty, B19200); // specific to KWL EC-270/370 Pro
-    cfsetospeed(&tty, B19200); // specific to KWL EC-270/370 Pro
+    else if (buf[1] == 1 && _p.dsize() == 5
+             && buf[3] >= Var_16_fan_1_voltage
+             && buf[3] <= Var_19_fan_4_voltage)
+      printf("\033[32mvoltage fan %d\033[m = %d.%dV (%dm³/h) / %d.%dV (%dm³/h)\n",
+             buf[3] - 0x15,
+             _p.u16(0) / 10, _p.u16(0) % 10, volume_flow(_p.u16(0)),
+             _p.u16(1) / 10, _p.u16(1) % 10, volume_flow(_p.u16(1)));
 
-    if (tcsetattr(_sp, TCSANOW, &tty) != 0)
-      { perror("tcsetattr"); return false; }
+    else if (_p.is_status(Var_1e_bypass1_temp, 3))
+      printf("\033[32mbypass1\033[m = %d.%d°C\n",
+             _bypass / 10, _bypass % 10);
 
-    return true;
+    else if (_p.is_status(Var_35_fan_level, 3))
+      {
+        if (_p.is_fan_no_change())
+          printf("\033[32mfan no change\033[m\n");
+        else if (_p.u8(0) == 0xaa && _p.u8(1) == 0)
+          printf("\033[32mset fan \033[1mMANUAL\033[m\n");
+        else if (_p.u8(0) == 0xaa && _p.u8(1) == 1)
+          printf("\033[32mset fan \033[1mAUTO\033[m\n");
+        else if (_p.u8(0) == 0xaa)
+          printf("\033[32mset fan AUTO/MANUAL %d\n", _p.u8(1));
+        else if (_p.u8(1) == 0xbb)
+          printf("\033[32mset fan\033[m \033[31mLEVEL %d\033[m\n", _p.u8(0));
+        else
+          printf("\033[32mset fan\033[m \033[31mLEVEL %d\033[m %d\n",
+                 _p.u8(0), _p.u8(1));
+      }
+
+    else if (_p.is_status(Var_38_change_filter, 2))
+      printf("\033[32mchange filter\033[m = %dmth\n", _p.u8(0));
+
+    else if (_p.is_status(Var_3b_sensors_co2, 9))
+      _p.print_got_co2();
+
+    else if (_p.is_status(Var_3c_sensors_humidity, 9))
+      _p.print_got_humidity();
+
+    else if (_p.is_status(Var_42_party_level, 2))
+      printf("\033[32mparty level\033[m = %d\n", _p.u8(0));
+
+    else if (_p.is_status(Var_49_nachlaufzeit, 2))
+      printf("\033[32mnachlaufzeit\033[m = %ds\n", _p.u8(0));
+
+    else if (_p.is_status(Var_4f_preheat_enabled, 2))
+      printf("\033[32mpre-heating\033[m = %s\n",
+             _p.u8(0) ? "enabled" : "disabled");
+
+    else if (_p.is_status(Var_54_quiet_curr_time, 3))
+      {
+        if (_quiet == 0)
+          printf("\033[32mquiet disabled\033[m\n");
+        else
+          printf("\033[32mquiet enabled for %dmin\n", _quiet);
+      }
+
+    else if (_p.is_status(Var_55_quiet_enabled, 2))
+      printf("\033[32mset quiet\033[m \033[1m%s\033[m (%d)\n",
+             _p.u8(0) ? "enabled" : "disabled", _p.u8(0));
+
+    else if (_p.is_status(Var_56_quiet_time, 2))
+      printf("\033[32mquiet time\033[m = %dmin\n", _p.u8(0));
+
+    else if (_p.is_status(Var_57_quiet_level, 2))
+      printf("\033[32mquiet level\033[m = %d\n", _p.u8(0));
+
+    else if (_p.is_status(Var_60_bypass2_temp, 2))
+      printf("\033[32mbypass2\033[m = %d°C\n", _p.u8(0));
+
+    else if (buf[0] == 0xff && buf[1] == 0xff)
+      {
+        int64_t now = get_time();
+        _p.print_status(_temp, _bypass, timer_left(_party, _party_read, now),
+                        timer_left(_quiet, _quiet_read, now), time != 0);
+      }
+
+    else
+      {
+        printf("%4lldms (%02x) ", time / 1000000, buf[0]);
+        _p.print("\033[1m", true); // uninterpreted
+      }
+  }
+
+  void begin_record(Encoder &e, int64_t ts) const
+  {
+    e.begin_record();
+    e.key("ts");
+    e.val_uint(ts);
+    if (_multi)
+      {
+        e.key("unit");
+        e.val_str(_name);
+      }
   }
 
-  bool uart_read(uint8_t *c)
-  { return (read(_sp, c, 1) == 1); }
+  void emit_frame(Encoder &e, Paket const &p, int64_t ts,
+                  char const *type) const
+  {
+    begin_record(e, ts);
+    e.key("type");
+    e.val_str(type);
+    e.key("frame");
+    e.val_bytes(p.raw(), p.size());
+    e.end_record();
+  }
 
-  void send_frame(uint8_t *buf, uint8_t size) const
+  // render a frame in machine-readable form, possibly on a worker thread
+  void render(Encoder &e, Frame_queue::Kind kind, Paket const &p,
+              int64_t ts) const
   {
-    if (size < 4)
-      { printf("\033[31msnd_frame: Invalid size!\n"); return; }
+    switch (kind)
+      {
+      case Frame_queue::Valid:   emit_paket(e, p, ts); break;
+      case Frame_queue::Invalid: emit_frame(e, p, ts, "invalid"); break;
+      case Frame_queue::Unknown: emit_frame(e, p, ts, "unknown"); break;
+      }
+  }
+
+  // render a frame now or leave it to the worker pool
+  void emit(Frame_queue::Kind kind, int64_t ts)
+  {
+    if (kind == Frame_queue::Valid && !opt_verbose && is_chatter())
+      return;
+    if (!_deferred)
+      render(_enc, kind, _p, ts);
+    else if (!_out.push(kind, ts, _p.raw(), _p.size()))
+      _stats.inc(Bus_stats::Dropped);
+  }
+
+  // machine-readable counterpart of print_paket()
+  void emit_paket(Encoder &e, Paket const &p, int64_t ts) const
+  {
+    uint8_t const *buf = p.raw();
+
+    if (buf[0] == 0xff && buf[1] == 0xff)
+      {
+        if (p.size() != 27)
+          { emit_frame(e, p, ts, "invalid"); return; }
+        begin_record(e, ts);
+        e.key("type");
+        e.val_str("status");
+        uint8_t date[3] = { buf[3], buf[5], buf[6] };
+        e.key("date");
+        encode_var(e, get_var_desc(Var_07_date_month_year), date, 3);
+        e.key("weekday");
+        e.val_uint(buf[4]);
+        e.key("time");
+        encode_var(e, get_var_desc(Var_08_time_hour_min), buf + 7, 2);
+        e.key("fan_level");
+        e.val_uint(buf[9]);
+        e.key("auto");
+        e.val_bool(buf[10]);
+        e.key("raw");
+        e.val_bytes(buf + 11, p.size() - 12);
+        e.end_record();
+        return;
+      }
+
+    begin_record(e, ts);
+    e.key("addr");
+    e.val_uint(buf[0]);
+    if (buf[1] == 0 && p.dsize() == 0)
+      {
+        e.key("type");
+        e.val_str("ping");
+      }
+    else if (buf[1] == 0 && p.dsize() == 1)
+      {
+        e.key("type");
+        e.val_str("request");
+        e.key("var");
+        e.val_uint(buf[3]);
+      }
+    else if (buf[1] == 5 && p.dsize() == 2 && buf[4] == 0x55)
+      {
+        e.key("type");
+        e.val_str("ack");
+        e.key("var");
+        e.val_uint(buf[3]);
+      }
+    else if (buf[1] == 1 && p.dsize() >= 1)
+      {
+        Var_desc const *d = get_var_desc(buf[3]);
+        e.key("type");
+        e.val_str("var");
+        e.key("var");
+        e.val_uint(buf[3]);
+        e.key("name");
+        e.val_str(d ? d->key : "unknown");
+        e.key("value");
+        encode_var(e, d, buf + 4, p.dsize() - 1);
+      }
+    else
+      {
+        e.key("type");
+        e.val_str("frame");
+        e.key("frame");
+        e.val_bytes(buf, p.size());
+      }
+    e.end_record();
+  }
+
+  void got_frame(int64_t time, uint8_t const *buf, unsigned size)
+  {
+    bool text = _enc.format() == Encoder::Text;
+    int64_t ts = text ? 0 : get_wall_ms();
+    int64_t now = get_time();
+
+    for (;; buf += _p.size(), size -= _p.size())
+      {
+        if (size < 4U)
+          return; // normal end or drop remaining
+
+        _p.new_paket(buf, size);
+        if (!_p.is_valid())
+          {
+            if (_first_frame)
+              _first_frame = false;
+            else
+              {
+                _stats.inc(Bus_stats::Bad_checksum);
+                if (text)
+                  {
+                    print_prefix();
+                    _p.print("\033[31mignoring ", false);
+                  }
+                else
+                  emit(Frame_queue::Invalid, ts);
+              }
+            return;
+          }
+
+        _first_frame = false;
+        ++_pakets_received;
+        _stats.frame(buf[0]);
+        if (buf[1] == 0 && _p.dsize() == 0)
+          {
+            _stats.poll(buf[0], now);
+            _schedule.ping(buf[0], _rx_last);
+            Extra_slots::Op op = take_sent(buf[0]);
+            if (opt_extra_slots)
+              _extra.poll(buf[0], buf[0] == Poll_us[0] ? Extra_slots::None : op);
+          }
+        else if (opt_extra_slots && _extra.frame(buf, _p.dsize()))
+          _stats.borrowed(_extra.polled(), true);
+        cache_paket(now);
+
+        if (!_p.is_start_status() && !_p.is_start_addr())
+          break;
+
+        if (_p.is_start_status())
+          memcpy(_status_buf, buf, sizeof(_status_buf));
+
+        update_state();
+        if (text)
+          print_paket(time);
+        else
+          emit(Frame_queue::Valid, ts);
+      }
+
+    // unknown paket
+    if (   !_p.is_ping(0x31) && !_p.is_ping(0x32)
+        && !_p.is_ping(0x34) && !_p.is_ping(0x38)
+        && !_p.is_ping(0x41) && !_p.is_ping(0x42)
+        && !_p.is_ping(0x44) && !_p.is_ping(0x48)
+        && !_p.is_ping(0x51) && !_p.is_ping(0x52)
+        && !_p.is_ping(0x54) && !_p.is_ping(0x58))
+      {
+        _stats.inc(Bus_stats::Unknown);
+        if (!text)
+          emit(Frame_queue::Unknown, ts);
+        else
+          {
+            print_prefix();
+            printf("%4lldms ", time / 1000000);
+            _p.print("\033[31munknown ", true);
+          }
+      }
+  }
+
+  // the master polled us
+  void our_turn(int64_t poll_time)
+  {
+    _stats.inc(Bus_stats::Our_slots);
+    if (opt_passive)
+      ; // only listen
+    else
+      {
+        if (_tx_prepared)
+          _stats.inc(Bus_stats::Prestaged);
+        else
+          prepare_turn();
+        transmit(poll_time);
+      }
+    if (_state_file[0] && poll_time - _state_saved > State_interval)
+      stage_state(poll_time);
+  }
+
+  // the master polled a free panel address: send a queued request there,
+  // the frame prepared for our own slot stays
+  void extra_turn(uint8_t addr, int64_t poll_time)
+  {
+    if (_requests.empty() && _job != Job_none)
+      job_step();
+    if (_requests.empty())
+      return;
+
+    uint8_t tx[sizeof(_tx)];
+    uint8_t tx_size = _tx_size;
+    bool tx_prepared = _tx_prepared;
+    memcpy(tx, _tx, sizeof(tx));
+
+    _tx_size = 0;
+    send_request();
+    if (_tx_size)
+      {
+        _tx[_tx_size - 1] += addr - _tx[0]; // checksum with the borrowed address
+        _tx[0] = addr;
+        _stats.borrowed(addr, false);
+        transmit(poll_time);
+      }
+
+    memcpy(_tx, tx, sizeof(tx));
+    _tx_size = tx_size;
+    _tx_prepared = tx_prepared;
+  }
+
+  // decide what to send in our next slot
+  void prepare_turn()
+  {
+    _silent.reset(); // the answers to earlier turns are over or lost
+    take_commands();
+    ++_our_cnt;
+    if (_our_cnt < 2)
+      ;
+    else if (initial_temp)
+      {
+        send_get_var(Var_3a_sensors_temp);
+        initial_temp = false;
+      }
+
+    //
+    // SETTER
+    //
+    else if (_set_time)
+      {
+        send_set_var_16bit(Var_08_time_hour_min, _set_time);
+        _set_time = 0;
+      }
+    else if (_set_bypass)
+      {
+        if (_set_bypass == 0xffff) // toggle
+          {
+            if (_bypass == 0xffff)
+              return; // wait until bypass temperature known
+            _set_bypass = (_bypass < 200) ? 28 : 18;
+          }
+        send_set_var_16bit(Var_1e_bypass1_temp, _set_bypass * 10);
+        _set_bypass = 0;
+      }
+    else if (_set_fan)
+      {
+        if (_set_fan == 0xe000 || _set_fan == 0xf000) // down/up
+          {
+            int change = (_set_fan == 0xf000) ? +1 : -1;
+            if (_fan_level == -1)
+              return; // wait until current fan level is available
+            if (   (change == -1 && (_fan_level < 2 || _fan_level > 4))
+                || (change == +1 && (_fan_level < 1 || _fan_level > 3)))
+              _set_fan = 0;
+            else
+              {
+                if (_fan_auto)
+                  {
+                    _set_fan = _fan_level + change;
+                    send_set_var_16bit(Var_35_fan_level, 0x00aa);
+                  }
+                else
+                  {
+                    send_set_var_16bit(Var_35_fan_level,
+                                       0xbb00 + _fan_level + change);
+                    _set_fan = 0;
+                  }
+              }
+          }
+        else if (_set_fan == 0xaa) // auto
+          {
+            send_set_var_16bit(Var_35_fan_level, 0x01aa);
+            _set_fan = 0;
+          }
+        else if (_set_fan & 0x100) // first: disable auto
+          {
+            send_set_var_16bit(Var_35_fan_level, 0x00aa);
+            _set_fan &= ~0x100;
+          }
+        else // set manual level
+          {
+            send_set_var_16bit(Var_35_fan_level, 0xbb00 + _set_fan);
+            _set_fan = 0;
+          }
+      }
+    else if (_set_party)
+      {
+        if (_set_party == 0xaa00)
+          {
+            send_set_var_8bit(Var_0f_party_enabled, 0);
+            _set_party = 0;
+          }
+        else if (_set_party == 0xaa01)
+          {
+            send_set_var_8bit(Var_0f_party_enabled, 1);
+            _set_party = 0;
+          }
+        else
+          {
+            send_set_var_16bit(Var_11_party_time, _set_party);
+            _set_party = 0xaa01;
+          }
+      }
+    else if (_set_quiet)
+      {
+        if (_set_quiet == 0xaa00)
+          {
+            send_set_var_8bit(Var_55_quiet_enabled, 0);
+            _set_quiet = 0;
+          }
+        else if (_set_quiet == 0xaa01)
+          {
+            send_set_var_8bit(Var_55_quiet_enabled, 1);
+            _set_quiet = 0;
+          }
+        else
+          {
+            send_set_var_16bit(Var_56_quiet_time, _set_quiet);
+            _set_quiet = 0xaa01;
+          }
+      }
+    else if (_set_voltage)
+      {
+        send_set_var_32bit(  Var_16_fan_1_voltage - 1
+                           + (_set_voltage & 0xf),
+                             (_set_voltage >> 16)
+                           | (_set_voltage & 0xffff0000));
+        _set_voltage = 0;
+      }
+    else if (_writes.next(get_time(), &_write))
+      {
+        // the fan needs to be set to manual before a level
+        if (   _write.idx == Var_35_fan_level && _write.data[1] == 0xbb
+            && _fan_auto != 0 && !_write.pre_done)
+          {
+            send_set_var_16bit(Var_35_fan_level, 0x00aa);
+            _writes.sent(_write, get_time(), true);
+          }
+        else
+          {
+            send_set_var(_write.idx, _write.data, _write.len);
+            _writes.sent(_write, get_time());
+          }
+      }
 
-    buf[2] = size - 4;
-    uint8_t chksum = 0;
-    for (uint8_t i = 0; i < size - 1; ++i)
-      chksum += buf[i];
-    chksum += 1;
-    buf[size - 1] = chksum;
-    sleep_ms(5);
-    int written = write(_sp, buf, size);
-    if (written != (ssize_t)size)
+    //
+    // GETTER
+    //
+    else if (opt_get_bypass == 2)
       {
-        printf("\033[31msnd_frame: Sent %d != %d bytes!\n", written, size);
-        return;
+        send_get_var(Var_60_bypass2_temp);
+        --opt_get_bypass;
+      }
+    else if (opt_get_bypass == 1)
+      {
+        send_get_var(Var_1e_bypass1_temp);
+        --opt_get_bypass;
+      }
+    else if (opt_get_hours_on)
+      {
+        send_get_var(Var_15_hours_on);
+        opt_get_hours_on = false;
+      }
+    else if (opt_get_voltage)
+      {
+        if (opt_get_voltage < 5)
+          send_get_var(Var_19_fan_4_voltage + 1 - opt_get_voltage);
+        --opt_get_voltage;
+      }
+    else if (opt_get_party_enabled)
+      {
+        send_get_var(Var_10_party_curr_time);
+        opt_get_party_enabled = false;
+      }
+    else if (opt_get_party_time)
+      {
+        send_get_var(Var_11_party_time);
+        opt_get_party_time = false;
+      }
+    else if (opt_get_party_level)
+      {
+        send_get_var(Var_42_party_level);
+        opt_get_party_level = false;
+      }
+    else if (opt_get_quiet_enabled)
+      {
+        send_get_var(Var_54_quiet_curr_time);
+        opt_get_quiet_enabled = false;
+      }
+    else if (opt_get_quiet_time)
+      {
+        send_get_var(Var_56_quiet_time);
+        opt_get_quiet_time = false;
+      }
+    else if (opt_get_quiet_level)
+      {
+        send_get_var(Var_57_quiet_level);
+        opt_get_quiet_level = false;
+      }
+    else if (opt_get_preheating)
+      {
+        if (opt_get_preheating == 2)
+          send_get_var(Var_4f_preheat_enabled);
+        else if (opt_get_preheating == 1)
+          send_get_var(Var_50_preheat_temp);
+        --opt_get_preheating;
+      }
+    else if (opt_get_run_on_time)
+      {
+        send_get_var(Var_49_nachlaufzeit);
+        opt_get_run_on_time = false;
+      }
+    else if (opt_get_filter_time)
+      {
+        send_get_var(Var_38_change_filter);
+        opt_get_filter_time = false;
       }
-    if (buf[3] != Var_3a_sensors_temp && false)
-      _p.print("\033[1msuccessful sent: ", true);
-  }
 
-  void send_get_var(uint8_t idx) const
-  {
-    uint8_t snd[5] = { 0x13, 0, 1, idx };
-    send_frame(snd, sizeof(snd));
-  }
+    //
+    // QUEUED REQUESTS (dump/restore/apply/calendar/scan)
+    //
+    else if (_job != Job_none || !_requests.empty())
+      {
+        if (_requests.empty())
+          job_step();
+        if (!_requests.empty())
+          send_request();
+      }
+    else if (!opt_do_loop)
+      _done = true;
 
-  void send_set_var_8bit(uint8_t idx, uint8_t val) const
-  {
-    uint8_t snd[6] = { 0x13, 1, 2, idx, val };
-    send_frame(snd, sizeof(snd));
+    //
+    // Low-frequency GETTERS
+    //
+    else if (timer_due(_party, _party_read, _party_sync, get_time()))
+      send_get_var(Var_10_party_curr_time);
+    else if (timer_due(_quiet, _quiet_read, _quiet_sync, get_time()))
+      send_get_var(Var_54_quiet_curr_time);
+    else
+      {
+        int idx = _reads.next(_cache, get_time(), _stats);
+        if (idx >= 0)
+          send_get_var(idx);
+      }
   }
 
-  void send_set_var_16bit(uint8_t idx, uint16_t val) const
+  // read the variables to be synchronised, then write those which differ
+  void start_sync()
   {
-    uint8_t snd[7] = { 0x13, 1, 3, idx,
-                       (uint8_t)(val % 256), (uint8_t)(val / 256) };
-    send_frame(snd, sizeof(snd));
+    _job = Job_sync;
+    for (unsigned i = 0; i < 256; ++i)
+      {
+        Var_desc const *d = get_var_desc(i);
+        if (!_snap->len(i) || !d || (d->flags & (Vf_ro | Vf_volatile)))
+          ;
+        else if (d->flags & Vf_wo)
+          _differ.set(i); // cannot be compared, only an apply sets these
+        else
+          _pending.set(i);
+      }
+    start_phase(false);
   }
 
-  void send_set_var_32bit(uint8_t idx, uint32_t val) const
+  void start_phase(bool writing)
   {
-    uint8_t snd[9] = { 0x13, 1, 5, idx,
-                       (uint8_t)(val & 0xff),
-                       (uint8_t)((val >> 8) & 0xff),
-                       (uint8_t)((val >> 16) & 0xff),
-                       (uint8_t)((val >> 24) & 0xff) };
-    send_frame(snd, sizeof(snd));
+    _writing = writing;
+    _tries = 0;
+    _phase_start = get_time();
   }
 
-  void print_calendar_level(unsigned level) const
+  // the variable of the current phase was read or written
+  bool job_var_done(unsigned idx)
   {
-    switch (level)
+    if (_writing)
+      return _acked.test(idx);
+    Var_cache::Entry e;
+    if (!_cache.load(idx, &e) || e.time < _phase_start)
+      return false;
+    if (_job == Job_dump)
       {
-      case 1: printf("__"); break;
-      case 2: printf("——"); break;
-      case 3: printf("‾‾"); break;
-      default: printf("% d", level); break;
+        _snap->set(idx, e.data, e.len);
+        return true;
       }
+    if (_job == Job_calendar)
+      {
+        _week.load(idx - Var_00_calendar_mon, e.data, e.len);
+        return true;
+      }
+    // a config has no opinion on the leading bytes of a calendar
+    if (_apply && get_var_desc(idx)->type == Vt_calendar && e.len >= 3)
+      {
+        uint8_t data[Var_cache::Max_data];
+        memcpy(data, _snap->data(idx), _snap->len(idx));
+        memcpy(data, e.data, 3);
+        _snap->set(idx, data, _snap->len(idx));
+      }
+    if (e.len != _snap->len(idx) || memcmp(e.data, _snap->data(idx), e.len))
+      _differ.set(idx);
+    return true;
   }
 
-  unsigned volume_flow(uint8_t v)
-  {
-    if (v <   1) return 0;
-    if (v <  24) return 60;
-    if (v <  30) return 80;
-    if (v <  37) return 100;
-    if (v <  43) return 120;
-    if (v <  50) return 140;
-    if (v <  56) return 160;
-    if (v <  63) return 180;
-    if (v <  69) return 200;
-    if (v <  76) return 220;
-    if (v <  82) return 240;
-    if (v <  89) return 260;
-    if (v <  95) return 280;
-    if (v < 100) return 300;
-    return 315;
-  }
-
-  void print_paket(uint64_t time)
+  // the request queue ran empty: collect the results, repeat what failed
+  void job_step()
   {
-    if (!opt_verbose
-        && (   _p.is_ping(0x10)
-            || _p.is_ping(0x11)
-            || _p.is_ping(0x12)
-            || _p.is_ping(0x13)
-            || _p.is_request(Var_35_fan_level)
-            || _p.is_request(Var_3a_sensors_temp)
-            || _p.is_request(Var_3b_sensors_co2)
-            || _p.is_request(Var_3c_sensors_humidity)
-            || _p.is_ack_10()
-            || _p.is_fan_no_change()
-           )
-       )
-      return;
-
-    uint8_t const *buf = _p.raw();
+    if (_job == Job_scan)
+      {
+        scan_step();
+        return;
+      }
 
-    if (buf[1] == 5 && _p.dsize() == 2 && buf[4] == 0x55)
-      printf("\033[32mack '%s' (%02x) written\033[m\n",
-             get_var_name(buf[3]), buf[3]);
+    // a variable left to the broadcast saved its read if it is done now
+    for (unsigned i = 0; i < 256; ++i)
+      if (_pending.test(i) && job_var_done(i))
+        {
+          _pending.reset(i);
+          if (_to_bcast.test(i))
+            _stats.inc(Bus_stats::Reads_saved);
+        }
+    _to_bcast.reset();
 
-    else if (false) // print all pakets
+    if (_pending.any() && _tries++ < Max_tries)
       {
-        printf("%4lldms (%02x) ", time / 1000000, buf[0]);
-        _p.print("\033[1m", true); // uninterpreted
+        // the first round leaves what the next broadcast brings anyway
+        Var_cache::Entry e;
+        bool bcast = !_writing && _tries == 1
+                     && _cache.load(Var_cache::Status, &e);
+        for (unsigned i = 0; i < 256; ++i)
+          if (!_pending.test(i))
+            ;
+          else if (bcast && in_broadcast(i))
+            _to_bcast.set(i);
+          else if (_writing)
+            _requests.write(i, _snap->data(i), _snap->len(i));
+          else
+            _requests.read(i);
+        return;
       }
 
-    else if (buf[1] == 1 && _p.dsize() == 28 && buf[3] <= Var_06_calendar_sun)
+    FILE *out = _enc.format() == Encoder::Text ? stdout : stderr;
+    char const *label = _multi ? _name : "";
+    char const *sep = _multi ? ": " : "";
+    char const *what = _job == Job_calendar ? "calendar"
+                     : _apply ? "apply" : "restore";
+    if (_job == Job_dump)
       {
-        for (unsigned i = 0; i < 24; ++i)
+        unsigned n = 0;
+        for (unsigned i = 0; i < 256; ++i)
+          n += _snap->len(i) != 0;
+        if (!_snap->save(_job_file))
+          _failed = true;
+        else
+          fprintf(out, "%s%s\033[32mdump\033[m %u variables saved to %s"
+                  " (%u not answered)\n", label, sep, n, _job_file,
+                  (unsigned)_pending.count());
+      }
+    else if (!_writing)
+      {
+        if (_job == Job_calendar)
+          calendar_edit();
+        // unreadable variables are written as well
+        _pending |= _differ;
+        start_phase(true);
+        if (_pending.any())
           {
-            print_calendar_level(buf[i + 7] & 0xf);
-            print_calendar_level(buf[i + 7] >> 4);
+            _acked.reset();
+            job_step();
+            return;
           }
-        printf("\n");
-        for (unsigned i = 0; i < 24; ++i)
-          printf("%-4d", i);
-        printf("\n");
+        if (_job != Job_calendar || opt_num_cal_edits)
+          fprintf(out, "%s%s\033[32m%s\033[m nothing to write\n",
+                  label, sep, what);
       }
-
-    else if (_p.is_status(Var_0e_preheat_temp, 3))
-      printf("\033[32mpre-heating\033[m = %d.%d°C\n",
-             _p.u16(0) / 10, _p.u16(0) % 10);
-
-    else if (_p.is_status(Var_10_party_curr_time, 3))
+    else
       {
-        _party = _p.u16(0);
-        if (!_interactive)
+        fprintf(out, "%s%s\033[32m%s\033[m %u variables written",
+                label, sep, what, (unsigned)_differ.count());
+        if (_pending.any())
           {
-            if (_party == 0)
-              printf("\033[32mparty disabled\033[m\n");
-            else
-              printf("\033[32mparty enabled for %dmin\n", _party);
+            fprintf(out, ", \033[31m%u not acknowledged\033[m",
+                    (unsigned)_pending.count());
+            _failed = true;
           }
+        fputc('\n', out);
       }
+    _job = Job_none;
+  }
 
-    else if (_p.is_status(Var_11_party_time, 3))
-      printf("\033[32mparty time\033[m = %dmin\n", _p.u16(0));
+  // queue the reads of a round, the answers go to the scan table as they
+  // come in. The next round reads all indices once more in case an answer
+  // was lost, the later rounds only those which answered.
+  void scan_step()
+  {
+    for (unsigned i = 0; i < 256 && _pending.any(); ++i)
+      if (_pending.test(i) && _requests.read(i))
+        _pending.reset(i);
+    if (!_requests.empty())
+      return;
 
-    else if (_p.is_status(Var_15_hours_on, 5))
+    // the answer to the last read has arrived as well by now
+    if (++_tries < Scan_table::Rounds)
       {
-        uint32_t h = _p.u32(0);
-        printf("\033[32mhours on\033[m = %dh (%d.%dyrs)\n",
-               h, ((h * 10) / (365 * 24)) / 10, ((h * 10) / (365 * 24)) % 10);
+        for (unsigned i = 0; i < 256; ++i)
+          if (_tries == 1 || _scan->answered(i))
+            _pending.set(i);
+        scan_step();
+        return;
       }
 
-    else if (buf[1] == 1 && _p.dsize() == 5
-             && buf[3] >= Var_16_fan_1_voltage
-             && buf[3] <= Var_19_fan_4_voltage)
-      printf("\033[32mvoltage fan %d\033[m = %d.%dV (%dm³/h) / %d.%dV (%dm³/h)\n",
-             buf[3] - 0x15,
-             _p.u16(0) / 10, _p.u16(0) % 10, volume_flow(_p.u16(0)),
-             _p.u16(1) / 10, _p.u16(1) % 10, volume_flow(_p.u16(1)));
-
-    else if (_p.is_status(Var_1e_bypass1_temp, 3))
+    unsigned n = 0, dyn = 0;
+    for (unsigned i = 0; i < 256; ++i)
       {
-        _bypass = _p.u16(0);
-        if (!_interactive)
-          printf("\033[32mbypass1\033[m = %d.%d°C\n",
-                 _bypass / 10, _bypass % 10);
+        n += _scan->answered(i);
+        dyn += _scan->dynamic(i);
       }
+    FILE *out = _enc.format() == Encoder::Text ? stdout : stderr;
+    if (!_scan->save(_job_file, _name))
+      _failed = true;
+    else
+      fprintf(out, "%s%s\033[32mscan\033[m %u indices answered (%u dynamic),"
+              " saved to %s\n", _multi ? _name : "", _multi ? ": " : "",
+              n, dyn, _job_file);
+    _job = Job_none;
+  }
 
-    else if (_p.is_status(Var_35_fan_level, 3))
+  // the days are read: edit them, show them and stage the changed days
+  void calendar_edit()
+  {
+    FILE *out = _enc.format() == Encoder::Text ? stdout : stderr;
+    for (unsigned d = 0; d < Week_calendar::Days; ++d)
+      if (_pending.test(Var_00_calendar_mon + d))
+        {
+          fprintf(out, "%s%s\033[31mcalendar %s not answered\033[m\n",
+                  _multi ? _name : "", _multi ? ": " : "", day_of_week[d]);
+          _failed = true;
+        }
+    _pending.reset(); // never write a day which is not known
+
+    for (unsigned i = 0; i < opt_num_cal_edits; ++i)
       {
-        if (_p.is_fan_no_change())
-          printf("\033[32mfan no change\033[m\n");
-        else if (_p.u8(0) == 0xaa && _p.u8(1) == 0)
-          printf("\033[32mset fan \033[1mMANUAL\033[m\n");
-        else if (_p.u8(0) == 0xaa && _p.u8(1) == 1)
-          printf("\033[32mset fan \033[1mAUTO\033[m\n");
-        else if (_p.u8(0) == 0xaa)
-          printf("\033[32mset fan AUTO/MANUAL %d\n", _p.u8(1));
-        else if (_p.u8(1) == 0xbb)
-          printf("\033[32mset fan\033[m \033[31mLEVEL %d\033[m\n", _p.u8(0));
-        else
-          printf("\033[32mset fan\033[m \033[31mLEVEL %d\033[m %d\n",
-                 _p.u8(0), _p.u8(1));
+        Cal_edit const &c = opt_cal_edits[i];
+        _week.set(c.days, c.from, c.to, c.level);
       }
 
-    else if (_p.is_status(Var_38_change_filter, 2))
-      printf("\033[32mchange filter\033[m = %dmth\n", _p.u8(0));
+    for (unsigned d = 0; d < Week_calendar::Days; ++d)
+      if (_week.changed(d))
+        {
+          _snap->set(Var_00_calendar_mon + d, _week.payload(d),
+                     Week_calendar::Size);
+          _differ.set(Var_00_calendar_mon + d);
+        }
 
-    else if (_p.is_status(Var_3a_sensors_temp, 21))
+    if (_enc.format() == Encoder::Text && opt_cal_days)
       {
-        for (unsigned i = 0; i < 4; ++i)
-          _temp[i] = _p.u16(1 + i);
+        print_prefix();
+        printf("    ");
+        for (unsigned h = 0; h < 24; ++h)
+          printf("%-4d", h);
+        printf("\n");
+        for (unsigned d = 0; d < Week_calendar::Days; ++d)
+          if ((opt_cal_days & (1U << d)) && _week.valid(d))
+            {
+              print_prefix();
+              printf("%s ", day_of_week[d]);
+              for (unsigned s = 0; s < Week_calendar::Slots; ++s)
+                print_calendar_level(_week.level(d, s));
+              printf("\n");
+            }
       }
+  }
 
-    else if (_p.is_status(Var_3b_sensors_co2, 9))
-      _p.print_got_co2();
+  Var_cache const &cache() const
+  { return _cache; }
 
-    else if (_p.is_status(Var_3c_sensors_humidity, 9))
-      _p.print_got_humidity();
+  Write_box const &writes() const
+  { return _writes; }
 
-    else if (_p.is_status(Var_42_party_level, 2))
-      printf("\033[32mparty level\033[m = %d\n", _p.u8(0));
+  Bus_stats &stats()
+  { return _stats; }
 
-    else if (_p.is_status(Var_49_nachlaufzeit, 2))
-      printf("\033[32mnachlaufzeit\033[m = %ds\n", _p.u8(0));
+  Bus_stats const &stats() const
+  { return _stats; }
 
-    else if (_p.is_status(Var_4f_preheat_enabled, 2))
-      printf("\033[32mpre-heating\033[m = %s\n",
-             _p.u8(0) ? "enabled" : "disabled");
+  uint64_t pakets_received() const
+  { return _pakets_received; }
 
-    else if (_p.is_status(Var_54_quiet_curr_time, 3))
+  void print_last_status()
+  {
+    if (_status_buf[2] != 0)
       {
-        _quiet = _p.u16(0);
-        if (!_interactive)
-          {
-            if (_quiet == 0)
-              printf("\033[32mquiet disabled\033[m\n");
-            else
-              printf("\033[32mquiet enabled for %dmin\n", _quiet);
-          }
+        _p.new_paket(_status_buf, sizeof(_status_buf));
+        print_paket(0);
       }
+  }
 
-    else if (_p.is_status(Var_55_quiet_enabled, 2))
-      printf("\033[32mset quiet\033[m \033[1m%s\033[m (%d)\n",
-             _p.u8(0) ? "enabled" : "disabled", _p.u8(0));
+private:
+  Paket _p;
+  uint16_t _temp[4] =
+  {
+    9990, // ↓ Außen
+    9990, // ← Abluft
+    9990, // ↑ Fortluft
+    9990  // → Zuluft
+  };
+  Var_cache _cache;
+  Bus_stats _stats;
+  Poll_schedule _schedule;
+  Extra_slots _extra;
+  int      _answered = -1;        // polled address we sent in, until the next poll
+  uint8_t  _rx_buf[128];
+  unsigned _rx_idx = 0;
+  int64_t  _rx_last = 0;
+  uint8_t  _tx[40];
+  uint8_t  _tx_size = 0;
+  bool     _tx_prepared = false;
+
+  static constexpr int64_t Frame_gap = 25000000;   // 25ms silence ends a frame
+  static constexpr int64_t Reply_delay = 5000000;  // 5ms after the poll
+  static constexpr int64_t Reply_window = 20000000; // master stops listening
+  static constexpr uint8_t Poll_us[4] = { 0x13, 0, 0, 0x14 };
+  static constexpr int64_t Timer_resync = 600000000000LL; // 10min
+  std::atomic<uint64_t> _pakets_received{0};
+  int      _request_idx = -1;
+  uint8_t  _request_from = 0;     // address of the panel which asked
+  int      _write_idx = -1;       // another panel wrote, ack pending
+  unsigned _write_len = 0;
+  uint8_t  _write_data[Var_cache::Max_data];
+  int      _sent_idx = -1;        // we wrote, ack pending
+  unsigned _sent_len = 0;
+  uint8_t  _sent_data[Var_cache::Max_data];
+
+  // a frame transmit() sent in the slot of a panel address, until the
+  // poll is processed
+  struct Sent
+  {
+    bool    valid = false;
+    bool    write = false;
+    uint8_t idx = 0;
+    uint8_t len = 0;
+    uint8_t data[Var_cache::Max_data];
+  };
+  Sent     _sent[4];              // by polled address 0x10..0x13
+  int      _sp = -1;
+  bool     _first_frame = true;
+  uint8_t  _status_buf[27] = { 0, };
+  int      _fan_level = -1;
+  int      _fan_auto = -1;
+  uint16_t _bypass = 0xffff;
+  uint16_t _party = 0;            // minutes left at _party_read
+  uint16_t _quiet = 0;
+  int64_t  _party_read = 0;
+  int64_t  _quiet_read = 0;
+  bool     _party_sync = false;   // read again soon, the state changed
+  bool     _quiet_sync = false;
+
+  char     _path[PATH_MAX];       // checked by scan_options()
+  char     _name[NAME_MAX + 1];
+  unsigned _unit;
+  bool     _multi;
+  bool     _locked = false;
+  bool     _done = false;
+  unsigned _our_cnt = 0;
+  Read_schedule _reads;
+  Command_queue _commands;
+  Write_box _writes;
+  Write_box::Write _write;
+  uint16_t _set_time = 0;         // settings taken from the commands
+  uint16_t _set_bypass = 0;
+  uint16_t _set_fan = 0;
+  uint16_t _set_party = 0;
+  uint16_t _set_quiet = 0;
+  uint32_t _set_voltage = 0;
+  bool     _deferred = false;
+  Frame_queue _out;
+
+  enum Job { Job_none, Job_dump, Job_sync, Job_calendar, Job_scan };
+  static constexpr unsigned Max_tries = 3;
+  Request_queue _requests;
+  Snapshot *_snap = nullptr;
+  Scan_table *_scan = nullptr;
+  Job      _job = Job_none;
+  bool     _writing = false;      // sync: write phase
+  bool     _apply = false;        // sync with a config, not a snapshot
+  bool     _failed = false;
+  unsigned _tries = 0;             // scan: round
+  int64_t  _phase_start = 0;
+  bool     _silent_answer = false; // the paket answers a queued read
+  std::bitset<256> _silent;       // queued reads not answered yet
+  std::bitset<256> _pending;      // not yet read/written in this phase
+  std::bitset<256> _differ;       // sync: differs from the snapshot
+  std::bitset<256> _acked;        // write acknowledged by the master
+  std::bitset<256> _to_bcast;     // left to the next broadcast
+  char     _job_file[PATH_MAX];
+  Week_calendar _week;
+  uint32_t _rules_holding = 0;    // mask of the --rules which hold
+  int      _rules_level = -1;     // fan level set by the rules, -1 = auto
+  static constexpr int64_t State_interval = 60000000000LL;
+  char     _state_file[PATH_MAX] = "";
+  int64_t  _state_time = 0;       // get_wall_ms() of the last value seen
+  int64_t  _state_saved = 0;
+  std::mutex _state_lock;         // guards the staged state
+  Warm_state _state_staged;
+  bool     _state_staged_ready = false;
+
+  enum Tune { Tune_off, Tune_before, Tune_after };
+  struct Tune_result
+  {
+    unsigned reads;
+    unsigned bytes;
+    int64_t  delay;
+  };
+  static constexpr int64_t Tune_window = 3000000000LL;
+  static constexpr int64_t Tune_settle = 1000000000LL;
+  static constexpr int64_t Byte_time = 520833; // 10 bits at 19200 baud
+  Tune     _tune = Tune_off;
+  int64_t  _tune_start = 0;
+  unsigned _tune_reads = 0;
+  unsigned _tune_bytes = 0;
+  int64_t  _tune_delay = 0;
+  Tune_result _tune_result[2] = {};
+  char     _tune_msg[128] = "no low-latency settings supported";
+  char     _latency_file[96] = "";
+  unsigned _latency_orig = 0;
+  int      _serial_flags_orig = 0;
+  bool     _serial_changed = false; // restore _serial_flags_orig at exit
+};
 
-    else if (_p.is_status(Var_56_quiet_time, 2))
-      printf("\033[32mquiet time\033[m = %dmin\n", _p.u8(0));
 
-    else if (_p.is_status(Var_57_quiet_level, 2))
-      printf("\033[32mquiet level\033[m = %d\n", _p.u8(0));
+// Renders the structured output of all units on a few threads, the bus
+// loop only decodes. A unit is handled by one worker at a time, which keeps
+// its frames in order; a worker running out of units steals from the
+// others.
+class Work_pool
+{
+public:
+  static constexpr unsigned Max_workers = 16;
 
-    else if (_p.is_status(Var_60_bypass2_temp, 2))
-      printf("\033[32mbypass2\033[m = %d°C\n", _p.u8(0));
+  ~Work_pool()
+  { stop(); }
 
-    else if (buf[0] == 0xff && buf[1] == 0xff)
-      {
-        _p.print_status(_temp, _bypass, _party, _quiet, time != 0);
-        _fan_level = buf[9];
-        _fan_auto  = buf[10] > 0;
-      }
+  void start(unsigned num)
+  {
+    _num = num;
+    for (unsigned i = 0; i < _num; ++i)
+      _workers[i].thread = std::thread([this, i] { run(i); });
+  }
 
-    else
+  // render everything still queued, then end the workers
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> g(_lock);
+      _stop = true;
+    }
+    _wake.notify_all();
+    for (unsigned i = 0; i < _num; ++i)
+      if (_workers[i].thread.joinable())
+        _workers[i].thread.join();
+  }
+
+  // kwl has queued frames
+  void schedule(Kwl *kwl)
+  {
+    if (!kwl->output().try_schedule())
+      return;
+    Worker &w = _workers[kwl->unit() % _num];
+    {
+      // count before publishing: take() must not see the unit first
+      std::lock_guard<std::mutex> g(_lock);
+      ++_ready;
+      std::lock_guard<std::mutex> gw(w.lock);
+      w.ready[w.tail++ % Max_units] = kwl;
+    }
+    _wake.notify_one();
+  }
+
+private:
+  struct Worker
+  {
+    std::mutex  lock;
+    Kwl        *ready[Max_units];  // a unit is queued at most once
+    unsigned    head = 0;
+    unsigned    tail = 0;
+    std::thread thread;
+    Encoder     enc;
+  };
+
+  void run(unsigned self)
+  {
+    Encoder &e = _workers[self].enc;
+    e.set_format(_enc.format());
+    for (;;)
       {
-        printf("%4lldms (%02x) ", time / 1000000, buf[0]);
-        _p.print("\033[1m", true); // uninterpreted
+        Kwl *kwl = take(self);
+        if (!kwl)
+          {
+            std::unique_lock<std::mutex> l(_lock);
+            _wake.wait(l, [this] { return _ready > 0 || _stop; });
+            if (_ready == 0)
+              return;
+            continue;
+          }
+
+        kwl->drain(e);
+        e.flush(); // before another worker may take the unit
+        kwl->output().release();
+        if (!kwl->output().empty())
+          schedule(kwl);
       }
   }
 
-  void got_frame(int64_t time, uint8_t const *buf, unsigned size)
+  // own units first, then steal
+  Kwl *take(unsigned self)
   {
-    for (;; buf += _p.size(), size -= _p.size())
+    for (unsigned i = 0; i < _num; ++i)
       {
-        if (size < 4U)
-          return; // normal end or drop remaining
-
-        _p.new_paket(buf, size);
-        if (!_p.is_valid())
+        Worker &w = _workers[(self + i) % _num];
+        std::lock_guard<std::mutex> g(w.lock);
+        if (w.head != w.tail)
           {
-            if (!_first_frame)
-              _p.print("\033[31mignoring ", false);
-            else
-              _first_frame = false;
-            return;
+            --_ready;
+            return w.ready[w.head++ % Max_units];
           }
+      }
+    return nullptr;
+  }
 
-        _first_frame = false;
-        ++_pakets_received;
+  Worker   _workers[Max_workers];
+  unsigned _num = 0;
+  std::mutex _lock;
+  std::condition_variable _wake;
+  std::atomic<unsigned> _ready{0};
+  bool     _stop = false;
+};
 
-        if (!_p.is_start_status() && !_p.is_start_addr())
-          break;
+// Writes the --state files in its own thread. Started before the bus loop
+// goes real-time, so it keeps the normal scheduling policy.
+class State_saver
+{
+public:
+  ~State_saver()
+  { stop(); }
 
-        if (_p.is_start_status())
-          memcpy(_status_buf, buf, sizeof(_status_buf));
+  void start(Kwl *const *units, unsigned num)
+  {
+    _units = units;
+    _num = num;
+    _thread = std::thread([this] { run(); });
+  }
 
-        print_paket(time);
-      }
+  void stop()
+  {
+    _stop = true;
+    if (_thread.joinable())
+      _thread.join();
+  }
 
-    // unknown paket
-    if (   !_p.is_ping(0x31) && !_p.is_ping(0x32)
-        && !_p.is_ping(0x34) && !_p.is_ping(0x38)
-        && !_p.is_ping(0x41) && !_p.is_ping(0x42)
-        && !_p.is_ping(0x44) && !_p.is_ping(0x48)
-        && !_p.is_ping(0x51) && !_p.is_ping(0x52)
-        && !_p.is_ping(0x54) && !_p.is_ping(0x58))
+private:
+  void run()
+  {
+    while (!_stop)
       {
-        printf("%4lldms ", time / 1000000);
-        _p.print("\033[31munknown ", true);
+        for (unsigned u = 0; u < _num; ++u)
+          _units[u]->write_staged_state();
+        sleep_ms(200);
       }
   }
 
-  void our_turn()
+  Kwl *const *_units = nullptr;
+  unsigned    _num = 0;
+  std::thread _thread;
+  std::atomic<bool> _stop{false};
+};
+
+// Minimal HTTP listener on localhost serving the cached state in the
+// OpenMetrics text format. Runs in its own thread and never touches the bus;
+// only with --control, /set and /get queue commands for the bus thread.
+class Metrics_server
+{
+public:
+  Metrics_server(Kwl *const *units, unsigned num)
+  : _units(units), _num(num),
+    _size(body_size(units, num)), _body(new char[_size])
+  {}
+
+  ~Metrics_server()
   {
-    static unsigned our_cnt = 0;
-    ++our_cnt;
-    if (our_cnt < 2)
-      ;
-    else if (initial_temp)
+    _stop = true;
+    if (_thread.joinable())
+      _thread.join();
+    if (_fd >= 0)
+      close(_fd);
+    for (Waiting &w: _waiting)
+      if (w.fd >= 0)
+        close(w.fd);
+    delete[] _body;
+  }
+
+  // control: also serve /set and /get, which queue commands for the bus
+  bool start(unsigned port, bool control)
+  {
+    _control = control;
+    _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0)
+      { perror("socket"); return false; }
+
+    int one = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      { perror("bind"); return false; }
+    if (listen(_fd, 4) < 0)
+      { perror("listen"); return false; }
+
+    _thread = std::thread([this] { run(); });
+    return true;
+  }
+
+private:
+  // a /set or /get request waiting for the units
+  struct Waiting
+  {
+    int      fd = -1;
+    Var_desc const *get;          // nullptr for /set
+    int64_t  since;
+    int64_t  deadline;
+    unsigned num;
+    unsigned unit[Max_units];
+    Write_box::Ticket tickets[Max_units];
+  };
+  static constexpr unsigned Max_waiting = 8;
+  static constexpr int64_t Var_timeout = 15000000000LL;
+  static constexpr int64_t Request_timeout = 1000000000LL;
+
+  void run()
+  {
+    while (!_terminate && !_stop)
       {
-        send_get_var(Var_3a_sensors_temp);
-        initial_temp = false;
+        struct pollfd pfd = { _fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, _num_waiting ? 20 : 200);
+        if (_num_waiting)
+          finish_sets();
+        if (ret <= 0)
+          continue;
+        int c = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (c < 0)
+          continue;
+        if (serve(c))
+          close(c);
       }
+  }
 
-    //
-    // SETTER
-    //
-    else if (opt_set_time)
+  // return false if the connection waits for the answer
+  bool serve(int c)
+  {
+    char req[1024];
+    unsigned len = 0;
+    // one deadline for the whole request, a slow client must not hold up
+    // the other scrapes and the waiting /set and /get
+    int64_t deadline = get_time() + Request_timeout;
+    while (len < sizeof(req) - 1)
       {
-        send_set_var_16bit(Var_08_time_hour_min, opt_set_time);
-        opt_set_time = 0;
+        int64_t left = deadline - get_time();
+        struct pollfd pfd = { c, POLLIN, 0 };
+        if (left <= 0 || poll(&pfd, 1, (int)((left + 999999) / 1000000)) <= 0)
+          return true;
+        ssize_t ret = read(c, req + len, sizeof(req) - 1 - len);
+        if (ret <= 0)
+          return true;
+        len += ret;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+          break;
       }
-    else if (opt_set_bypass)
+    req[len] = '\0';
+
+    _len = 0;
+    char const *status = "200 OK";
+    char const *type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET /metrics?", 13))
+      render_metrics();
+    else if (!strncmp(req, "GET /stats ", 11))
       {
-        if (opt_set_bypass == 0xffff) // toggle
+        // one JSON object per unit
+        type = _num > 1 ? "application/jsonl" : "application/json";
+        Encoder e;
+        e.set_fd(-1);
+        e.set_format(Encoder::Jsonl);
+        for (unsigned u = 0; u < _num; ++u)
           {
-            if (_bypass == 0xffff)
-              return; // wait until bypass temperature known
-            opt_set_bypass = (_bypass < 200) ? 28 : 18;
+            encode_stats(e, _units[u]->stats(), _units[u]->label());
+            append("%.*s", (int)e.size(), e.data());
+            e.clear();
           }
-        send_set_var_16bit(Var_1e_bypass1_temp, opt_set_bypass * 10);
-        opt_set_bypass = 0;
       }
-    else if (opt_set_fan)
+    else if (!strncmp(req, "POST /set?", 10) || !strncmp(req, "GET /get?", 9))
       {
-        if (opt_set_fan == 0xe000 || opt_set_fan == 0xf000) // down/up
-          {
-            int change = (opt_set_fan == 0xf000) ? +1 : -1;
-            if (_fan_level == -1)
-              return; // wait until current fan level is available
-            if (   (change == -1 && (_fan_level < 2 || _fan_level > 4))
-                || (change == +1 && (_fan_level < 1 || _fan_level > 3)))
-              opt_set_fan = 0;
-            else
-              {
-                if (_fan_auto)
-                  {
-                    opt_set_fan = _fan_level + change;
-                    send_set_var_16bit(Var_35_fan_level, 0x00aa);
-                  }
-                else
-                  {
-                    send_set_var_16bit(Var_35_fan_level,
-                                       0xbb00 + _fan_level + change);
-                    opt_set_fan = 0;
-                  }
-                _fan_level = -1; // re-read
-                _fan_auto = -1;
-              }
-          }
-        else if (opt_set_fan == 0xaa) // auto
+        type = "text/plain";
+        if (!_control)
           {
-            send_set_var_16bit(Var_35_fan_level, 0x01aa);
-            opt_set_fan = 0;
+            status = "403 Forbidden";
+            append("not enabled, see --control\n");
           }
-        else if (opt_set_fan & 0x100) // first: disable auto
+        else if (strcasestr(req, "\nOrigin:"))
           {
-            send_set_var_16bit(Var_35_fan_level, 0x00aa);
-            opt_set_fan &= ~0x100;
+            // sent by browsers, a page must not control the unit
+            status = "403 Forbidden";
+            append("cross-origin request\n");
           }
-        else // set manual level
+        else
           {
-            send_set_var_16bit(Var_35_fan_level, 0xbb00 + opt_set_fan);
-            opt_set_fan = 0;
+            status = serve_var(c, strchr(req, '?') + 1, req[0] == 'G');
+            if (!status)
+              return false;
           }
       }
-    else if (opt_set_party)
+    else if (!strncmp(req, "GET /set?", 9))
       {
-        if (opt_set_party == 0xaa00)
-          {
-            send_set_var_8bit(Var_0f_party_enabled, 0);
-            opt_set_party = 0;
-          }
-        else if (opt_set_party == 0xaa01)
-          {
-            send_set_var_8bit(Var_0f_party_enabled, 1);
-            opt_set_party = 0;
-          }
-        else
-          {
-            send_set_var_16bit(Var_11_party_time, opt_set_party);
-            opt_set_party = 0xaa01;
-          }
+        status = "405 Method Not Allowed";
+        type = "text/plain";
+        append("use POST\n");
       }
-    else if (opt_set_quiet)
+    else
+      {
+        status = "404 Not Found";
+        type = "text/plain";
+        append("not found\n");
+      }
+    respond(c, status, type);
+    return true;
+  }
+
+  void respond(int c, char const *status, char const *type)
+  {
+    char hdr[256];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.0 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %u\r\n"
+                     "Connection: close\r\n\r\n", status, type, _len);
+    if (write_all(c, hdr, n))
+      write_all(c, _body, _len);
+  }
+
+  // POST /set?KEY=VALUE[&unit=DEV]: write a variable of all units (or of
+  // DEV) with the key of --apply; fan_level takes auto or 1..4.
+  // GET /get?KEY[&unit=DEV]: read a variable from the bus, one JSON object
+  // per unit. The answer follows once the units acknowledged or answered.
+  // Return the HTTP status of an immediate answer, nullptr if waiting.
+  char const *serve_var(int c, char *query, bool get)
+  {
+    char *end = strchr(query, ' ');
+    if (end)
+      *end = '\0';
+    char const *unit = nullptr;
+    char const *key = nullptr;
+    char const *value = nullptr;
+    char *save;
+    for (char *p = strtok_r(query, "&", &save); p; p = strtok_r(nullptr, "&", &save))
       {
-        if (opt_set_quiet == 0xaa00)
+        char *eq = strchr(p, '=');
+        if (eq)
           {
-            send_set_var_8bit(Var_55_quiet_enabled, 0);
-            opt_set_quiet = 0;
+            *eq = '\0';
+            url_decode(eq + 1);
           }
-        else if (opt_set_quiet == 0xaa01)
+        if (!strcmp(p, "unit") && eq)
+          unit = eq + 1;
+        else if (key)
           {
-            send_set_var_8bit(Var_55_quiet_enabled, 1);
-            opt_set_quiet = 0;
+            append("one variable per request\n");
+            return "400 Bad Request";
           }
         else
           {
-            send_set_var_16bit(Var_56_quiet_time, opt_set_quiet);
-            opt_set_quiet = 0xaa01;
+            key = p;
+            value = eq ? eq + 1 : nullptr;
           }
       }
-    else if (opt_set_voltage)
-      {
-        send_set_var_32bit(  Var_16_fan_1_voltage - 1
-                           + (opt_set_voltage & 0xf),
-                             (opt_set_voltage >> 16)
-                           | (opt_set_voltage & 0xffff0000));
-        opt_set_voltage = 0;
-      }
 
-    //
-    // GETTER
-    //
-    else if (opt_get_bypass == 2)
-      {
-        send_get_var(Var_60_bypass2_temp);
-        --opt_get_bypass;
-      }
-    else if (opt_get_bypass == 1)
-      {
-        send_get_var(Var_1e_bypass1_temp);
-        --opt_get_bypass;
-      }
-    else if (opt_get_hours_on)
-      {
-        send_get_var(Var_15_hours_on);
-        opt_get_hours_on = false;
-      }
-    else if (opt_get_voltage)
+    Var_desc const *d = key ? find_var_desc(key) : nullptr;
+    uint8_t data[Var_cache::Max_data];
+    unsigned len = 2;
+    if (!d)
       {
-        if (opt_get_voltage < 5)
-          send_get_var(Var_19_fan_4_voltage + 1 - opt_get_voltage);
-        --opt_get_voltage;
+        append("unknown variable\n");
+        return "400 Bad Request";
       }
-    else if (opt_get_party_enabled)
+    if (get)
       {
-        send_get_var(Var_10_party_curr_time);
-        opt_get_party_enabled = false;
+        if (d->flags & Vf_wo)
+          {
+            append("%s cannot be read\n", d->key);
+            return "400 Bad Request";
+          }
       }
-    else if (opt_get_party_time)
+    else if (!value)
       {
-        send_get_var(Var_11_party_time);
-        opt_get_party_time = false;
+        append("%s: value missing\n", d->key);
+        return "400 Bad Request";
       }
-    else if (opt_get_party_level)
+    else if (d->idx == Var_35_fan_level)
       {
-        send_get_var(Var_42_party_level);
-        opt_get_party_level = false;
+        data[0] = 0xaa;
+        data[1] = 0x01;
+        if (strcmp(value, "auto"))
+          {
+            char *e;
+            unsigned long l = strtoul(value, &e, 10);
+            data[0] = l;
+            data[1] = 0xbb;
+            if (*e != '\0' || l < 1 || l > 4)
+              {
+                append("fan_level: auto or 1..4\n");
+                return "400 Bad Request";
+              }
+          }
       }
-    else if (opt_get_quiet_enabled)
+    else if (   (d->flags & Vf_ro) || d->type == Vt_calendar
+             || !parse_var(d, value, data, &len))
       {
-        send_get_var(Var_54_quiet_curr_time);
-        opt_get_quiet_enabled = false;
+        append("%s cannot be set to '%s'\n", d->key, value);
+        return "400 Bad Request";
       }
-    else if (opt_get_quiet_time)
+
+    Waiting *w = nullptr;
+    for (Waiting &i: _waiting)
+      if (i.fd < 0)
+        w = &i;
+    if (!w)
       {
-        send_get_var(Var_56_quiet_time);
-        opt_get_quiet_time = false;
+        append("busy\n");
+        return "503 Service Unavailable";
       }
-    else if (opt_get_quiet_level)
+    w->get = get ? d : nullptr;
+    w->since = get_time();
+    w->num = 0;
+    for (unsigned u = 0; u < _num; ++u)
+      if (unit && strcmp(unit, _units[u]->name()))
+        ;
+      else if (get ? _units[u]->queue_read(d->idx)
+                   : _units[u]->queue_write(d->idx, data, len,
+                                            &w->tickets[w->num]))
+        w->unit[w->num++] = u;
+      else
+        append("%s busy\n", _units[u]->name());
+    if (!w->num)
       {
-        send_get_var(Var_57_quiet_level);
-        opt_get_quiet_level = false;
+        if (_len)
+          return "503 Service Unavailable";
+        append("unknown unit\n");
+        return "404 Not Found";
       }
-    else if (opt_get_cal)
+    w->fd = c;
+    w->deadline = w->since + Var_timeout;
+    ++_num_waiting;
+    return nullptr;
+  }
+
+  // the write of a /set or the read of a /get is through
+  Write_box::Result result(Waiting const &w, unsigned i) const
+  {
+    Kwl const *k = _units[w.unit[i]];
+    if (!w.get)
+      return k->writes().result(w.tickets[i]);
+    Var_cache::Entry e;
+    if (k->cache().load(w.get->idx, &e) && e.time >= w.since)
+      return Write_box::Done;
+    return Write_box::Pending;
+  }
+
+  // answer the /set and /get requests which are through or timed out
+  void finish_sets()
+  {
+    int64_t now = get_time();
+    for (Waiting &w: _waiting)
       {
-        send_get_var(Var_00_calendar_mon + opt_get_cal - 1);
-        opt_get_cal = 0;
+        if (w.fd < 0)
+          continue;
+        unsigned done = 0, failed = 0;
+        for (unsigned i = 0; i < w.num; ++i)
+          {
+            Write_box::Result r = result(w, i);
+            done += r == Write_box::Done;
+            failed += r == Write_box::Failed;
+          }
+        if (done + failed < w.num && now < w.deadline)
+          continue;
+
+        char const *type = "text/plain";
+        _len = 0;
+        Encoder e;
+        e.set_fd(-1);
+        e.set_format(Encoder::Jsonl);
+        for (unsigned i = 0; i < w.num; ++i)
+          {
+            Kwl const *k = _units[w.unit[i]];
+            Write_box::Result r = result(w, i);
+            if (!w.get)
+              {
+                append("%s %s\n", k->name(),
+                       r == Write_box::Done ? "written"
+                       : r == Write_box::Failed ? "not acknowledged"
+                       : "timeout");
+                continue;
+              }
+            type = "application/jsonl";
+            Var_cache::Entry v;
+            e.begin_record();
+            e.key("unit");
+            e.val_str(k->name());
+            e.key(w.get->key);
+            if (r == Write_box::Done && k->cache().load(w.get->idx, &v))
+              encode_var(e, w.get, v.data, v.len);
+            else
+              e.val_null();
+            e.end_record();
+            append("%.*s", (int)e.size(), e.data());
+            e.clear();
+          }
+        respond(w.fd, done == w.num ? "200 OK"
+                      : failed ? "502 Bad Gateway" : "504 Gateway Timeout",
+                type);
+        close(w.fd);
+        w.fd = -1;
+        --_num_waiting;
       }
-    else if (opt_get_preheating)
+  }
+
+  static void url_decode(char *s)
+  {
+    char *d = s;
+    for (; *s; ++s)
+      if (*s == '+')
+        *d++ = ' ';
+      else if (*s == '%' && isxdigit(s[1]) && isxdigit(s[2]))
+        {
+          char hex[3] = { s[1], s[2], '\0' };
+          *d++ = (char)strtoul(hex, nullptr, 16);
+          s += 2;
+        }
+      else
+        *d++ = *s;
+    *d = '\0';
+  }
+
+  static bool write_all(int fd, char const *p, unsigned n)
+  {
+    while (n)
       {
-        if (opt_get_preheating == 2)
-          send_get_var(Var_4f_preheat_enabled);
-        else if (opt_get_preheating == 1)
-          send_get_var(Var_50_preheat_temp);
-        --opt_get_preheating;
+        ssize_t ret = write(fd, p, n);
+        if (ret < 0 && errno == EINTR)
+          continue;
+        if (ret <= 0)
+          return false;
+        p += ret;
+        n -= ret;
       }
-    else if (opt_get_run_on_time)
+    return true;
+  }
+
+  void __attribute__((format(printf, 2, 3))) append(char const *fmt, ...)
+  {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(_body + _len, _size - _len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+      _len += (unsigned)n < _size - _len ? n : _size - _len - 1;
+  }
+
+  // the metadata of a metric family precedes its first sample
+  void family(char const *name, char const *type, char const *help)
+  {
+    _family = name;
+    _family_type = type;
+    _family_help = help;
+  }
+
+  void header()
+  {
+    if (!_family)
+      return;
+    append("# TYPE %s %s\n# HELP %s %s\n",
+           _family, _family_type, _family, _family_help);
+    _family = nullptr;
+  }
+
+  // labels of a sample: the unit plus optional further labels
+  char const *labels(Kwl const *k, char const *fmt = nullptr, ...)
+    __attribute__((format(printf, 3, 4)))
+  {
+    int n = snprintf(_labels, sizeof(_labels), "{unit=\"%s\"", k->name());
+    if (fmt)
       {
-        send_get_var(Var_49_nachlaufzeit);
-        opt_get_run_on_time = false;
+        _labels[n++] = ',';
+        va_list ap;
+        va_start(ap, fmt);
+        n += vsnprintf(_labels + n, sizeof(_labels) - n - 1, fmt, ap);
+        va_end(ap);
       }
-    else if (opt_get_filter_time)
+    snprintf(_labels + n, sizeof(_labels) - n, "}");
+    return _labels;
+  }
+
+  void sample_tenths(char const *labels, int v)
+  {
+    header();
+    append("%s%s %s%d.%d\n", _sample, labels,
+           v < 0 ? "-" : "", abs(v) / 10, abs(v) % 10);
+  }
+
+  void sample_uint(char const *labels, unsigned long long v)
+  {
+    header();
+    append("%s%s %llu\n", _sample, labels, v);
+  }
+
+  // sensor values of a variable, skipping absent sensors
+  void sensors(uint8_t idx, char const *name, char const *help,
+               char const *const *names, unsigned first, unsigned count)
+  {
+    family(name, "gauge", help);
+    _sample = name;
+    uint16_t invalid = get_var_desc(idx)->invalid;
+    for (unsigned u = 0; u < _num; ++u)
       {
-        send_get_var(Var_38_change_filter);
-        opt_get_filter_time = false;
+        Var_cache::Entry e;
+        if (!_units[u]->cache().load(idx, &e))
+          continue;
+        for (unsigned i = 0; i < count; ++i)
+          {
+            uint16_t v = e.u16(first + i);
+            if (2 * (first + i) + 1 < e.len && v != invalid)
+              sample_tenths(labels(_units[u], "sensor=\"%s\"", names[i]),
+                            (int16_t)v);
+          }
       }
-    else if (!opt_do_loop)
-      _terminate = true;
-
-    //
-    // Low-frequency GETTERS
-    //
-    else if ((our_cnt % 4) == 3)
-      send_get_var(Var_3a_sensors_temp);
-    else if (_party && ((our_cnt % 8) == 2))
-      send_get_var(Var_10_party_curr_time);
-    else if (_quiet && ((our_cnt % 8) == 2))
-      send_get_var(Var_54_quiet_curr_time);
   }
 
-  void print_last_status()
+  void render_metrics()
   {
-    if (_status_buf[2] != 0)
+    static char const *const temp_names[4] =
+    {
+      "outdoor",       // ↓ Außen
+      "extract",       // ← Abluft
+      "exhaust",       // ↑ Fortluft
+      "supply",        // → Zuluft
+    };
+    static char const *const sensor_names[4] = { "1", "2", "3", "4" };
+
+    sensors(Var_3a_sensors_temp, "kwl_temperature_celsius",
+            "Temperature of the air streams.", temp_names, 1, 4);
+    sensors(Var_3b_sensors_co2, "kwl_co2_ppm",
+            "CO2 concentration.", sensor_names, 0, 4);
+    sensors(Var_3c_sensors_humidity, "kwl_humidity_percent",
+            "Relative humidity.", sensor_names, 0, 4);
+
+    Var_cache::Entry e;
+    family(_sample = "kwl_fan_level", "gauge", "Current fan level.");
+    for (unsigned u = 0; u < _num; ++u)
+      if (_units[u]->cache().load(Var_cache::Status, &e))
+        sample_uint(labels(_units[u]), e.data[6]);
+
+    family(_sample = "kwl_fan_auto", "gauge", "Fan in automatic mode.");
+    for (unsigned u = 0; u < _num; ++u)
+      if (_units[u]->cache().load(Var_cache::Status, &e))
+        sample_uint(labels(_units[u]), e.data[7] ? 1 : 0);
+
+    family(_sample = "kwl_fan_voltage_volts", "gauge", "Fan voltage per fan level.");
+    for (unsigned u = 0; u < _num; ++u)
+      for (unsigned l = 0; l < 4; ++l)
+        if (_units[u]->cache().load(Var_16_fan_1_voltage + l, &e) && e.len >= 4)
+          {
+            sample_tenths(labels(_units[u], "level=\"%u\",air=\"supply\"", l + 1),
+                          e.u16(0));
+            sample_tenths(labels(_units[u], "level=\"%u\",air=\"extract\"", l + 1),
+                          e.u16(1));
+          }
+
+    family(_sample = "kwl_hours_on", "gauge", "Operating hours.");
+    for (unsigned u = 0; u < _num; ++u)
+      if (_units[u]->cache().load(Var_15_hours_on, &e) && e.len >= 4)
+        sample_uint(labels(_units[u]), e.u32(0));
+
+    family(_sample = "kwl_filter_change_months", "gauge",
+           "Months until the filter must be changed.");
+    for (unsigned u = 0; u < _num; ++u)
+      if (_units[u]->cache().load(Var_38_change_filter, &e) && e.len >= 1)
+        sample_uint(labels(_units[u]), e.data[0]);
+
+    family("kwl_bus_utilisation_percent", "gauge", "Share of time the bus was busy.");
+    header();
+    for (unsigned u = 0; u < _num; ++u)
+      append("kwl_bus_utilisation_percent%s %.1f\n",
+             labels(_units[u]), _units[u]->stats().utilisation());
+
+    family("kwl_bus_frames", "counter", "Valid frames per sender address.");
+    header();
+    _sample = "kwl_bus_frames_total";
+    for (unsigned u = 0; u < _num; ++u)
+      for (unsigned a = 0; a < 256; ++a)
+        if (_units[u]->stats().frames(a))
+          sample_uint(labels(_units[u], "addr=\"0x%02x\"", a),
+                      _units[u]->stats().frames(a));
+
+    static struct { Bus_stats::Counter c; char const *name, *help; } const counters[] =
+    {
+      { Bus_stats::Bad_checksum, "kwl_bus_checksum_errors", "Frames ignored due to a wrong checksum." },
+      { Bus_stats::Overflows,    "kwl_bus_overflows",       "Receive buffer overflows." },
+      { Bus_stats::Unknown,      "kwl_bus_unknown_frames",  "Frames from unknown senders." },
+      { Bus_stats::Our_slots,    "kwl_bus_slots",           "Polls of our address." },
+      { Bus_stats::Prestaged,    "kwl_bus_slots_prestaged", "Polls answered with a frame prepared in advance." },
+      { Bus_stats::Deadline_misses, "kwl_bus_deadline_misses", "Answers sent after the reply window." },
+      { Bus_stats::Dropped,      "kwl_frames_dropped",      "Frames not rendered because the workers fell behind." },
+      { Bus_stats::Harvested,    "kwl_values_harvested",    "Values taken from the traffic of other panels." },
+      { Bus_stats::Reads_saved,  "kwl_reads_saved",         "Reads not sent because the value was fresh." },
+    };
+    char total[48];
+    for (auto const &c: counters)
       {
-        _p.new_paket(_status_buf, sizeof(_status_buf));
-        print_paket(0);
+        family(c.name, "counter", c.help);
+        snprintf(total, sizeof(total), "%s_total", c.name);
+        _sample = total;
+        for (unsigned u = 0; u < _num; ++u)
+          sample_uint(labels(_units[u]), _units[u]->stats().get(c.c));
       }
+
+    family("kwl_heap_allocations", "counter",
+           "Heap allocations since the bus loop started.");
+    header();
+    append("kwl_heap_allocations_total %u\n", heap_allocs_in_loop());
+
+    family("kwl_pakets_received", "counter", "Valid pakets received from the bus.");
+    _sample = "kwl_pakets_received_total";
+    for (unsigned u = 0; u < _num; ++u)
+      sample_uint(labels(_units[u]), _units[u]->pakets_received());
+    append("# EOF\n");
   }
 
-private:
-  Paket _p;
-  uint16_t _temp[4] =
+  // every sample repeats the unit label, a unit has less than 64 samples
+  static unsigned body_size(Kwl *const *units, unsigned num)
   {
-    9990, // ↓ Außen
-    9990, // ← Abluft
-    9990, // ↑ Fortluft
-    9990  // → Zuluft
-  };
-  uint64_t _pakets_received = 0;
-  int      _sp = -1;
-  bool     _first_frame = true;
-  uint8_t  _status_buf[27] = { 0, };
-  int      _fan_level = -1;
-  int      _fan_auto = -1;
-  uint16_t _bypass = 0xffff;
-  uint16_t _party = 0;
-  uint16_t _quiet = 0;
+    unsigned size = 4096;
+    for (unsigned u = 0; u < num; ++u)
+      size += 4096 + 64 * strlen(units[u]->name());
+    return size;
+  }
 
-public:
-  bool     opt_do_loop = false;
-  uint16_t opt_set_time = 0;
-  uint16_t opt_set_bypass = 0;
-  uint16_t opt_set_fan = 0;
-  uint16_t opt_set_party = 0;
-  uint16_t opt_set_quiet = 0;
-  uint32_t opt_set_voltage = 0;
-  unsigned opt_get_bypass = 0;
-  unsigned opt_get_cal = 0;
-  bool     opt_get_hours_on = false;
-  bool     opt_get_party_enabled = false;
-  bool     opt_get_party_time = false;
-  bool     opt_get_party_level = false;
-  bool     opt_get_quiet_enabled = false;
-  bool     opt_get_quiet_time = false;
-  bool     opt_get_quiet_level = false;
-  unsigned opt_get_voltage = 0;
-  unsigned opt_get_preheating = 0;
-  bool     opt_get_run_on_time = false;
-  bool     opt_get_filter_time = false;
-  bool     opt_verbose = false;
-  bool     initial_temp = true;
+  Kwl *const  *_units;
+  unsigned     _num;
+  int          _fd = -1;
+  Waiting      _waiting[Max_waiting];
+  unsigned     _num_waiting = 0;
+  std::thread  _thread;
+  std::atomic<bool> _stop{false};
+  unsigned     _size;         // sized for the number of units
+  char        *_body;
+  unsigned     _len = 0;
+  char         _labels[NAME_MAX + 96];
+  bool         _control = false;
+  char const  *_family = nullptr;
+  char const  *_family_type = nullptr;
+  char const  *_family_help = nullptr;
+  char const  *_sample = nullptr;
 };
 
 void print_help()
@@ -1089,9 +5543,11 @@ void print_help()
     "\n"
     " -?, --help                show this help\n"
     " -l, --loop                loop execution until Ctrl-C / ESC\n"
+    " -d, --device DEV          serial port of a unit (default " DEVICE "),\n"
+    "                           repeat to drive several units at once\n"
     "\n"
     "     --get-bypass          get bypass temperatures (°C)\n"
-    "     --get-calendar DAY    get calendar for a specific day (0/Mon..6/Sun)\n"
+    "     --get-calendar DAY    get calendar for a specific day (0/Mon..6/Sun, all)\n"
     "     --get-change-filter   get time before change filter (mth)\n"
     "     --get-hours-on        get number of hours (h)\n"
     "     --get-party-enabled   get remaining time for party\n"
@@ -1108,14 +5564,60 @@ void print_help()
     " -f, --set-fan a|m:LEVEL   set fan level (auto or manual level 1..4)\n"
     " -p, --set-party 0|1|TIME  set party (disable/enable/time)\n"
     " -q, --set-quiet 0|1|TIME  set quiet (disable/enable/time)\n"
+    "     --set-calendar DAYS@HH:MM-HH:MM=LEVEL\n"
+    "                           set the level of a time range (DAYS: 0..6, 0-4, all)\n"
     " -t, --set-time HH:MM      set time of day\n"
     " -v, --set-voltage L:V     set voltage for a certain level\n"
     "\n"
+    "     --format FMT          output format (text|jsonl|cbor)\n"
+    "     --metrics PORT        serve OpenMetrics on localhost:PORT (implies --loop),\n"
+    "                           bus statistics as JSON on /stats\n"
+    "     --control             with --metrics, also set variables with\n"
+    "                           POST /set?KEY=VALUE[&unit=DEV] (keys as in --apply)\n"
+    "                           and read them with GET /get?KEY[&unit=DEV]\n"
+    "     --stats               print bus statistics on exit\n"
+    "     --realtime[=CPU]      run the bus loop with real-time priority (pinned to CPU)\n"
+    "     --workers N           render jsonl/cbor output on N threads\n"
+    "     --extra-slots         send queued requests (dump, restore, apply, calendar,\n"
+    "                           scan) also in the slots of absent remote panels\n"
+    "     --low-latency         low-latency settings of a USB serial port, with the\n"
+    "                           receive delay measured before and after\n"
+    "     --passive             never send, show what the other panels read and\n"
+    "                           write (implies --loop)\n"
+    "\n"
+    "     --dump FILE           save all variables to FILE (FILE.DEV with several units)\n"
+    "     --restore FILE        write the variables of FILE which differ\n"
+    "     --apply FILE          write the settings of FILE (key = value) which differ\n"
+    "     --scan FILE           read all 256 indices and save the unknown variables\n"
+    "                           found to FILE (FILE.DEV with several units)\n"
+    "     --vars FILE           variable descriptors as saved by --scan\n"
+    "     --rules FILE          set the fan level by CO₂/humidity thresholds\n"
+    "                           (\"co2|humidity THRESHOLD LEVEL [HYSTERESIS]\"),\n"
+    "                           implies --loop\n"
+    "     --state FILE          start with the state saved to FILE by the last run\n"
+    "                           and save it there (FILE.DEV with several units)\n"
     "     --verbose             show incoming pakets\n"
     );
 }
 
-static int scan_options(Kwl &kwl, int argc, char **argv)
+static char const *opt_devices[Max_units];
+static unsigned opt_num_devices;
+static unsigned opt_workers;
+static char const *opt_dump;
+static char const *opt_restore;
+static char const *opt_apply;
+static char const *opt_scan;
+static char const *opt_vars;
+static char const *opt_rules;
+static char const *opt_state;
+static bool     opt_low_latency;
+static unsigned opt_metrics_port;
+static bool     opt_control;
+static bool     opt_stats;
+static bool     opt_realtime;
+static int      opt_realtime_cpu = -1;
+
+static int scan_options(Kwl_opts &kwl, int argc, char **argv)
 {
   for (;;)
     {
@@ -1135,6 +5637,7 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
         { "get-pre-heating",   no_argument,       0,  10 },
         { "get-voltage",       no_argument,       0,   4 },
         { "get-run-on-time",   no_argument,       0,  11 },
+        { "device",            required_argument, 0, 'd' },
         { "help",              no_argument,       0, '?' },
         { "loop",              no_argument,       0, 'l' },
         { "interactive",       no_argument,       0, 'i' },
@@ -1143,14 +5646,36 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
         { "set-party",         required_argument, 0, 'p' },
         { "set-time",          required_argument, 0, 't' },
         { "set-voltage",       required_argument, 0, 'v' },
-        { "verbose",           no_argument,       0,  15 }
+        { "verbose",           no_argument,       0,  15 },
+        { "format",            required_argument, 0,  16 },
+        { "metrics",           required_argument, 0,  17 },
+        { "stats",             no_argument,       0,  18 },
+        { "realtime",          optional_argument, 0,  19 },
+        { "workers",           required_argument, 0,  20 },
+        { "dump",              required_argument, 0,  21 },
+        { "restore",           required_argument, 0,  22 },
+        { "apply",             required_argument, 0,  23 },
+        { "set-calendar",      required_argument, 0,  24 },
+        { "scan",              required_argument, 0,  25 },
+        { "vars",              required_argument, 0,  26 },
+        { "rules",             required_argument, 0,  27 },
+        { "state",             required_argument, 0,  28 },
+        { "low-latency",       no_argument,       0,  29 },
+        { "extra-slots",       no_argument,       0,  30 },
+        { "passive",           no_argument,       0,  31 },
+        { "control",           no_argument,       0,  32 },
+        { 0,                   0,                 0,   0 }
       };
 
       int opts_index;
-      int c = getopt_long(argc, argv, "?b:ilf:p:q:t:v:", long_opts, &opts_index);
+      int c = getopt_long(argc, argv, "?b:d:ilf:p:q:t:v:", long_opts, &opts_index);
       if (c == -1)
         break;
 
+      // the --get options (1..14) read from the unit
+      if (c >= 1 && c <= 14)
+        kwl.opt_reads = true;
+
       unsigned long u0, u1, u2;
       char *nptr;
       switch (c)
@@ -1160,10 +5685,54 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
           return 2;
 
         case 2:
+          if (!strcmp(optarg, "all"))
+            {
+              kwl.opt_cal_days = 0x7f;
+              break;
+            }
           u0 = strtoul(optarg, &nptr, 10);
-          if (u0 > 6)
+          if (u0 > 6 || *nptr != '\0')
             { printf("get-calendar: wrong day\n"); return 1; }
-          kwl.opt_get_cal = u0 + 1;
+          kwl.opt_cal_days |= 1U << u0;
+          break;
+
+        case 24:
+          {
+            // DAYS@HH:MM-HH:MM=LEVEL, DAYS: all, a day or a range of days
+            if (kwl.opt_num_cal_edits == Kwl_opts::Max_cal_edits)
+              { printf("set-calendar: too many changes\n"); return 1; }
+            Kwl_opts::Cal_edit &c = kwl.opt_cal_edits[kwl.opt_num_cal_edits];
+            if (!strncmp(optarg, "all", 3))
+              {
+                u0 = 0;
+                u1 = 6;
+                nptr = optarg + 3;
+              }
+            else
+              {
+                u0 = u1 = strtoul(optarg, &nptr, 10);
+                if (*nptr == '-')
+                  u1 = strtoul(nptr + 1, &nptr, 10);
+              }
+            if (u0 > u1 || u1 > 6 || *nptr != '@')
+              { printf("set-calendar: wrong days\n"); return 1; }
+            c.days = (0x7f >> (6 - u1)) & (0x7f << u0);
+
+            unsigned h0, m0, h1, m1, lvl;
+            int pos = 0;
+            if (sscanf(nptr + 1, "%2u:%2u-%2u:%2u=%u%n",
+                       &h0, &m0, &h1, &m1, &lvl, &pos) != 5
+                || nptr[1 + pos] != '\0'
+                || (m0 != 0 && m0 != 30) || (m1 != 0 && m1 != 30)
+                || h0 * 2 + m0 / 30 >= h1 * 2 + m1 / 30 || h1 * 2 + m1 / 30 > 48)
+              { printf("set-calendar: wrong time range\n"); return 1; }
+            if (lvl > 4)
+              { printf("set-calendar: wrong level\n"); return 1; }
+            c.from = h0 * 2 + m0 / 30;
+            c.to = h1 * 2 + m1 / 30;
+            c.level = lvl;
+            ++kwl.opt_num_cal_edits;
+          }
           break;
 
         case 3:
@@ -1173,18 +5742,30 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
         case 'b':
           u0 = strtoul(optarg, &nptr, 10);
           if (u0 == 0)
-            kwl.opt_set_bypass = 28;
+            kwl.add_command(Command::Set_bypass, 28);
           else if (u0 == 1)
-            kwl.opt_set_bypass = 18;
+            kwl.add_command(Command::Set_bypass, 18);
           else if (u0 < 18 || u0 > 30)
             { printf("set-bypass: temperature out of range\n"); return 1; }
-          kwl.opt_set_bypass = u0;
+          else
+            kwl.add_command(Command::Set_bypass, u0);
           // fall-through
 
         case 1:
           kwl.opt_get_bypass = 2;
           break;
 
+        case 'd':
+          if (opt_num_devices >= Max_units)
+            { printf("device: too many units\n"); return 1; }
+          // relative names are below /dev
+          if (strlen(optarg) + (optarg[0] == '/' ? 0 : 5) >= PATH_MAX
+              || strlen(strrchr(optarg, '/') ? strrchr(optarg, '/') + 1
+                                             : optarg) > NAME_MAX)
+            { printf("device: path too long: %s\n", optarg); return 1; }
+          opt_devices[opt_num_devices++] = optarg;
+          break;
+
         case 'i':
         case 'l':
           _interactive = true;
@@ -1192,21 +5773,19 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
           kwl.opt_get_bypass = 1;
           kwl.opt_get_party_enabled = true;
           kwl.opt_get_quiet_enabled = true;
-          printf(
-            "In interactive mode -- abort with Ctrl-C or ESC.\n"
-            "↑..increase fan, ↓..decrease fan, a..auto mode, b..toggle bypass.\n");
           break;
 
         case 'f':
           if (optarg[0] == 'a')
-            kwl.opt_set_fan = 0xaa;
+            kwl.add_command(Command::Set_fan, 0xaa);
           else if (optarg[0] == 'm')
             {
               if (optarg[1] != ':')
                 { printf("set-fan: wrong manual format\n"); return 1; }
               if (optarg[2] < '1' || optarg[3] > '4')
                 { printf("set-fan: wrong manual level\n"); return 1; }
-              kwl.opt_set_fan = (1U << 8) | (optarg[2] - '0');
+              kwl.add_command(Command::Set_fan,
+                              (1U << 8) | (optarg[2] - '0'));
             }
           else
             { printf("set-fan: a/m:<level>\n"); return 1; }
@@ -1214,29 +5793,29 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
 
         case 'p':
           if (optarg[0] == '0' && optarg[1] == '\0')
-            kwl.opt_set_party = 0xaa00;
+            kwl.add_command(Command::Set_party, 0xaa00);
           else if (optarg[0] == '1' && optarg[1] == '\0')
-            kwl.opt_set_party = 0xaa01;
+            kwl.add_command(Command::Set_party, 0xaa01);
           else
             {
               u0 = strtoul(optarg, &nptr, 10);
               if (u0 > 120 || *nptr != '\0')
                 { printf("set-party: wrong format\n"); return 1; }
-              kwl.opt_set_party = u0;
+              kwl.add_command(Command::Set_party, u0);
             }
           break;
 
         case 'q':
           if (optarg[0] == '0')
-            kwl.opt_set_quiet = 0xaa00;
+            kwl.add_command(Command::Set_quiet, 0xaa00);
           else if (optarg[0] == '1')
-            kwl.opt_set_quiet = 0xaa01;
+            kwl.add_command(Command::Set_quiet, 0xaa01);
           else
             {
               u0 = strtoul(optarg, &nptr, 10);
               if (u0 > 120 || *nptr != '\0')
                 { printf("set-quiet: wrong format\n"); return 1; }
-              kwl.opt_set_quiet = u0;
+              kwl.add_command(Command::Set_quiet, u0);
             }
           break;
 
@@ -1251,7 +5830,8 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
             { printf("set-time: wrong minutes\n"); return 1; }
           if (*nptr != '\0')
             { printf("set-time: wrong format %d\n", *nptr); return 1; }
-          kwl.opt_set_time = (uint16_t)u0 + (uint16_t)(u1 << 8);
+          kwl.add_command(Command::Set_time,
+                          (uint16_t)u0 + (uint16_t)(u1 << 8));
           break;
 
         case 'v':
@@ -1275,7 +5855,7 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
             }
           if (u1 > 100)
             { printf("set-voltage: voltage too high\n"); return 1; }
-          kwl.opt_set_voltage = u0 + (u1 << 16);
+          kwl.add_command(Command::Set_voltage, u0 + (u1 << 16));
           // fall-through
 
         case 4:
@@ -1337,6 +5917,94 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
           kwl.opt_verbose = true;
           break;
 
+        case 16:
+          if (!strcmp(optarg, "text"))
+            _enc.set_format(Encoder::Text);
+          else if (!strcmp(optarg, "jsonl"))
+            _enc.set_format(Encoder::Jsonl);
+          else if (!strcmp(optarg, "cbor"))
+            _enc.set_format(Encoder::Cbor);
+          else
+            { printf("format: text|jsonl|cbor\n"); return 1; }
+          break;
+
+        case 17:
+          u0 = strtoul(optarg, &nptr, 10);
+          if (u0 == 0 || u0 > 65535 || *nptr != '\0')
+            { printf("metrics: wrong port\n"); return 1; }
+          opt_metrics_port = u0;
+          kwl.opt_do_loop = true;
+          kwl.opt_export = true;
+          break;
+
+        case 18:
+          opt_stats = true;
+          break;
+
+        case 19:
+          opt_realtime = true;
+          if (optarg)
+            {
+              u0 = strtoul(optarg, &nptr, 10);
+              if (*nptr != '\0' || u0 >= CPU_SETSIZE)
+                { printf("realtime: wrong CPU\n"); return 1; }
+              opt_realtime_cpu = u0;
+            }
+          break;
+
+        case 20:
+          u0 = strtoul(optarg, &nptr, 10);
+          if (u0 == 0 || u0 > Work_pool::Max_workers || *nptr != '\0')
+            { printf("workers: 1..%u\n", Work_pool::Max_workers); return 1; }
+          opt_workers = u0;
+          break;
+
+        case 21:
+          opt_dump = optarg;
+          break;
+
+        case 22:
+          opt_restore = optarg;
+          break;
+
+        case 23:
+          opt_apply = optarg;
+          break;
+
+        case 25:
+          opt_scan = optarg;
+          break;
+
+        case 26:
+          opt_vars = optarg;
+          break;
+
+        case 27:
+          opt_rules = optarg;
+          kwl.opt_do_loop = true;
+          break;
+
+        case 28:
+          opt_state = optarg;
+          break;
+
+        case 29:
+          opt_low_latency = true;
+          break;
+
+        case 30:
+          kwl.opt_extra_slots = true;
+          break;
+
+        case 31:
+          kwl.opt_passive = true;
+          kwl.opt_do_loop = true;
+          break;
+
+        case 32:
+          opt_control = true;
+          break;
+
         default:
           printf("Unknown option '%c'\n", c);
           return 1;
@@ -1346,103 +6014,381 @@ static int scan_options(Kwl &kwl, int argc, char **argv)
   return 0;
 }
 
+// keyboard commands of the interactive mode, return false to quit
+static bool handle_key(Kwl &kwl, int key)
+{
+  if (key == Key_decoder::Key_none)
+    return true;
+
+  printf("\r\033[K");
+  fflush(stdout);
+  if (key == Key_decoder::Key_esc)
+    return false;
+  else if (kwl.opt_passive)
+    ; // nothing can be set
+  else if (key == Key_decoder::Key_up)
+    kwl.command(Command::Fan_step, +1);
+  else if (key == Key_decoder::Key_down)
+    kwl.command(Command::Fan_step, -1);
+  else if (key == 'a') // set fan to auto
+    kwl.command(Command::Set_fan, 0xaa);
+  else if (key == 'b') // toggle bypass
+    kwl.command(Command::Set_bypass, 0xffff);
+  return true;
+}
+
+// Drive all units from one thread until terminated or all units are done.
+// Keyboard commands go to the first unit. With a pool, the workers render
+// the output of the units.
+static bool run_loop(Kwl *const *units, unsigned num, Work_pool *pool)
+{
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0)
+    { perror("epoll_create1"); return false; }
+
+  for (unsigned u = 0; u < num; ++u)
+    {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = units[u];
+      if (epoll_ctl(ep, EPOLL_CTL_ADD, units[u]->uart_fd(), &ev) < 0)
+        { perror("epoll_ctl"); close(ep); return false; }
+    }
+
+  // keys, unless stdin cannot be polled (/dev/null)
+  Key_decoder keys;
+  if (_interactive)
+    {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = nullptr;
+      epoll_ctl(ep, EPOLL_CTL_ADD, 0, &ev);
+    }
+
+  // commands of other threads
+  if (_command_fd >= 0)
+    {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &_command_fd;
+      if (epoll_ctl(ep, EPOLL_CTL_ADD, _command_fd, &ev) < 0)
+        { perror("epoll_ctl"); close(ep); return false; }
+    }
+
+  // steady state from here on
+  _heap_loop.store(_heap_allocs.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+  _heap_loop_started.store(true, std::memory_order_release);
+  for (;;)
+    {
+      int64_t now = get_time();
+      int64_t timeout = -1;
+      bool busy = false;
+      for (unsigned u = 0; u < num; ++u)
+        {
+          int64_t t = units[u]->rx_timeout(now);
+          if (t == 0)
+            units[u]->rx_flush(now);
+          else if (t > 0 && (timeout < 0 || t < timeout))
+            timeout = t;
+          if (pool && !units[u]->output().empty())
+            pool->schedule(units[u]);
+          busy |= !units[u]->done();
+        }
+      if (_terminate || !busy)
+        break;
+
+      struct epoll_event ev[16];
+      int n = epoll_wait(ep, ev, 16,
+                         timeout < 0 ? -1 : (int)((timeout + 999999) / 1000000));
+      if (n <= 0)
+        continue;
+
+      bool quit = false;
+      for (int i = 0; i < n; ++i)
+        {
+          if (ev[i].data.ptr == &_command_fd)
+            {
+              uint64_t n;
+              if (read(_command_fd, &n, sizeof(n)) > 0)
+                for (unsigned u = 0; u < num; ++u)
+                  units[u]->take_commands();
+              continue;
+            }
+
+          Kwl *kwl = (Kwl *)ev[i].data.ptr;
+          if (!kwl)
+            {
+              uint8_t k[16];
+              ssize_t len = read(0, k, sizeof(k));
+              if (len == 0 || (len < 0 && errno != EINTR && errno != EAGAIN))
+                epoll_ctl(ep, EPOLL_CTL_DEL, 0, nullptr); // no more keys
+              for (ssize_t j = 0; j < len; ++j)
+                quit |= !handle_key(*units[0], keys.feed(k[j]));
+              quit |= !handle_key(*units[0], keys.end());
+              continue;
+            }
+
+          uint8_t c[64];
+          ssize_t len = kwl->uart_read(c, sizeof(c));
+          if (len < 0 && errno != EINTR && errno != EAGAIN)
+            {
+              perror(kwl->name());
+              epoll_ctl(ep, EPOLL_CTL_DEL, kwl->uart_fd(), nullptr);
+              kwl->finish();
+              continue;
+            }
+          now = get_time();
+          for (ssize_t j = 0; j < len; ++j)
+            kwl->rx_byte(c[j], now);
+          if (pool && !kwl->output().empty())
+            pool->schedule(kwl);
+        }
+      if (quit)
+        break;
+    }
+
+  close(ep);
+  return true;
+}
+
 } // namespace
 
+// counted for --stats: no allocation is expected once the loop runs
+void *operator new(size_t size)
+{
+  _heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+// Not inlined: GCC would otherwise see free() of a pointer from operator
+// new at the call sites and warn with -Wmismatched-new-delete.
+NOINLINE void operator delete(void *p) noexcept
+{ free(p); }
+
+NOINLINE void operator delete(void *p, size_t) noexcept
+{ free(p); }
+
 int main(int argc, char **argv)
 {
-  unsigned y;
-  get_maxy(&_maxy);
-  get_y(&y);
-  if (y >= _maxy)
+  Kwl_opts opts;
+
+  int retval = scan_options(opts, argc, argv);
+  if (retval != 0)
+    return retval;
+
+  if (opt_num_devices == 0)
+    opt_devices[opt_num_devices++] = DEVICE;
+
+  bool calendar = opts.opt_cal_days || opts.opt_num_cal_edits;
+  if (!!opt_dump + !!opt_restore + !!opt_apply + calendar + !!opt_scan > 1)
     {
-      putchar('\n');
-      --y;
+      printf("dump, restore, apply, calendar and scan cannot be combined\n");
+      return 1;
     }
-  set_maxy(_maxy - 1, _maxy - 1);
-  fflush(stdout);
-  signal(SIGINT, signal_handler);
 
-  printf("Helios KWL control\n");
+  if (opt_control && !opt_metrics_port)
+    {
+      printf("--control needs --metrics\n");
+      return 1;
+    }
 
-  Kwl kwl;
+  if (   opts.opt_passive
+      && (   opt_dump || opt_restore || opt_apply || calendar || opt_scan
+          || opt_rules || opts.opt_extra_slots || opts.has_settings()
+          || opts.opt_reads || opt_control))
+    {
+      printf("--passive cannot be combined with options which send\n");
+      return 1;
+    }
 
-  if (!kwl.uart_open())
+  if (opt_vars && !read_var_overlay(opt_vars))
     return 1;
 
-  int retval = 0;
-  if (open("/var/lock/" DEVICE, O_CREAT | O_EXCL | O_WRONLY, S_IWUSR) > 0)
+  Fan_rules rules;
+  if (opt_rules)
+    {
+      if (!rules.load(opt_rules))
+        return 1;
+      opts.opt_rules = &rules;
+    }
+
+  // the same settings for all units
+  Snapshot *config = nullptr;
+  if (opt_apply)
+    {
+      config = new Snapshot;
+      if (!read_config(opt_apply, config))
+        {
+          delete config;
+          return 1;
+        }
+    }
+
+  // no terminal control sequences in machine-readable output
+  bool text = _enc.format() == Encoder::Text;
+  if (text && opt_workers)
+    {
+      printf("workers: only with --format jsonl|cbor\n");
+      return 1;
+    }
+
+  unsigned y;
+  if (text)
+    {
+      get_maxy(&_maxy);
+      get_y(&y);
+      if (y >= _maxy)
+        {
+          putchar('\n');
+          --y;
+        }
+      set_maxy(_maxy - 1, _maxy - 1);
+      fflush(stdout);
+    }
+  signal(SIGINT, signal_handler);
+  if (text)
+    signal(SIGWINCH, winch_handler);
+
+  if (text)
     {
-      if (kwl.uart_setup())
+      printf("Helios KWL control\n");
+      if (_interactive)
+        printf(
+          "In interactive mode -- abort with Ctrl-C or ESC.\n"
+          "↑..increase fan, ↓..decrease fan, a..auto mode, b..toggle bypass.\n");
+    }
+
+  // units which cannot be used are left out
+  Kwl *units[Max_units];
+  unsigned num = 0;
+  bool multi = opt_num_devices > 1;
+  for (unsigned i = 0; i < opt_num_devices; ++i)
+    {
+      Kwl *kwl = new Kwl(opts, opt_devices[i], num, multi);
+      bool ok = kwl->uart_open() && kwl->lock();
+      if (ok && !kwl->uart_setup())
+        {
+          printf("Cannot setup %s\n", opt_devices[i]);
+          ok = false;
+        }
+
+      // with several units, every unit has its own file
+      char file[PATH_MAX];
+      if (snprintf(file, sizeof(file), multi ? "%s.%s" : "%s",
+                   opt_dump ? opt_dump : opt_restore ? opt_restore
+                   : opt_scan ? opt_scan : "", kwl->name())
+          >= (int)sizeof(file))
+        {
+          printf("%s: file name too long\n", kwl->name());
+          ok = false;
+        }
+      if (ok && opt_restore)
+        ok = kwl->start_restore(file);
+      else if (ok && opt_dump)
+        kwl->start_dump(file);
+      else if (ok && opt_scan)
+        kwl->start_scan(file);
+      else if (ok && config)
+        kwl->start_apply(*config);
+      else if (ok && calendar)
+        kwl->start_calendar();
+
+      if (ok && opt_low_latency)
+        kwl->start_low_latency();
+      if (ok && opt_state)
         {
-          retval = scan_options(kwl, argc, argv);
-          if (retval == 0)
+          if (snprintf(file, sizeof(file), multi ? "%s.%s" : "%s", opt_state,
+                       kwl->name()) < (int)sizeof(file))
+            kwl->use_state(file);
+          else
             {
-              unsigned idx = 0;
-              uint8_t buf[128];
-
-              do
-                {
-                  int64_t time = get_time();
-
-                  uint8_t c;
-                  if (!kwl.uart_read(&c))
-                    continue;
-
-                  if (_interactive)
-                    {
-                      int d1, d2, d3;
-                      if (peek_input(&d1, &d2, &d3))
-                        {
-                          printf("\r\033[K");
-                          fflush(stdout);
-                          if (d1 == '\033')
-                            {
-                              if (d2 == '\0')
-                                break; // single ESCape -- terminate
-                              if (d2 == '[')
-                                {
-                                  if (d3 == 'A')
-                                    kwl.opt_set_fan = 0xf000; // up
-                                  else if (d3 == 'B')
-                                    kwl.opt_set_fan = 0xe000; // down
-                                }
-                            }
-                          else if (d1 == 'a') // set fan to auto
-                            kwl.opt_set_fan = 0xaa;
-                          else if (d1 == 'b') // toggle bypass
-                            kwl.opt_set_bypass = 0xffff, kwl.opt_get_bypass = 1;
-                        }
-                    }
-
-                  time = get_time() - time;
-                  if (time >= 25000000)
-                    {
-                      kwl.got_frame(time, buf, idx);
-                      idx = 0;
-                    }
-
-                  if (idx >= sizeof(buf))
-                    {
-                      printf("\033[31mBuffer overflow\033[m\n");
-                      idx = 0;
-                      continue;
-                    }
-
-                  buf[idx++] = c;
-
-                  if (idx == 4 && *(uint32_t *)buf == 0x14000013)
-                    kwl.our_turn();
-                }
-              while (!_terminate);
+              printf("%s: file name too long\n", kwl->name());
+              ok = false;
             }
         }
-      else
-        printf("Cannot setup /dev/" DEVICE "\n");
 
-      unlink("/var/lock/" DEVICE);
+      if (!ok)
+        {
+          delete kwl;
+          retval = 1;
+          continue;
+        }
+      units[num++] = kwl;
+    }
+
+  delete config;
+
+  if (num)
+    {
+      // started before going real-time: only the bus loop is
+      Work_pool pool;
+      if (opt_workers)
+        {
+          for (unsigned u = 0; u < num; ++u)
+            units[u]->defer_output();
+          pool.start(opt_workers);
+        }
+
+      if (_interactive)
+        term_raw();
+      // wakes the bus loop when the metrics thread queues commands
+      _command_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      Metrics_server metrics(units, num);
+      State_saver saver;
+      if (opt_state)
+        saver.start(units, num);
+      if (opt_metrics_port && !metrics.start(opt_metrics_port, opt_control))
+        retval = 1;
+      else if (opt_realtime && !setup_realtime(opt_realtime_cpu))
+        retval = 1;
+      else if (!run_loop(units, num, opt_workers ? &pool : nullptr))
+        retval = 1;
+      term_restore();
+      saver.stop(); // before the final save below
+      if (_command_fd >= 0)
+        close(_command_fd);
+      _command_fd = -1;
+
+      // all frames rendered before the statistics
+      for (unsigned u = 0; u < num; ++u)
+        if (opt_workers && !units[u]->output().empty())
+          pool.schedule(units[u]);
+      pool.stop();
+
+      for (unsigned u = 0; u < num; ++u)
+        {
+          units[u]->tune_report();
+          units[u]->save_state();
+          if (units[u]->failed())
+            retval = 1;
+        }
+    }
+
+  // the stats record carries them with --stats; keep the stream clean
+  if (opt_realtime && !opt_stats)
+    for (unsigned u = 0; u < num; ++u)
+      if (units[u]->stats().get(Bus_stats::Our_slots))
+        fprintf(text ? stdout : stderr,
+                "%s%sreply deadline misses: %u of %u slots\n",
+                units[u]->label() ? units[u]->label() : "",
+                units[u]->label() ? ": " : "",
+                units[u]->stats().get(Bus_stats::Deadline_misses),
+                units[u]->stats().get(Bus_stats::Our_slots));
+
+  if (!text)
+    {
+      for (unsigned u = 0; u < num; ++u)
+        {
+          if (opt_stats)
+            encode_stats(_enc, units[u]->stats(), units[u]->label());
+          delete units[u];
+        }
+      _enc.flush();
+      return retval;
     }
-  else
-    printf("Cannot lock /var/lock/" DEVICE "\n");
 
   get_y(&y);
   set_maxy(_maxy);
@@ -1452,8 +6398,15 @@ int main(int argc, char **argv)
   set_maxy(_maxy);
   set_y(y);
   fflush(stdout);
-  kwl.print_last_status();
+  if (num)
+    units[0]->print_last_status();
   putchar('\n');
+  for (unsigned u = 0; u < num; ++u)
+    {
+      if (opt_stats)
+        print_stats(units[u]->stats(), units[u]->label());
+      delete units[u];
+    }
 
   return retval;
 }